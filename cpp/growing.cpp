@@ -2,51 +2,128 @@
 
 #include <iostream>
 #include <cassert>
+#include <algorithm>
+#include <limits>
+#include <stdexcept>
 #include "growing.hpp"
 
 using namespace std;
 
-Pixel::Pixel(int row, int col, State state)
-: row(row), col(col), state(state)
-{}
-
-bool operator<(const Pixel& lhs, const Pixel& rhs)
+StatePlane::StatePlane(int rows, int cols, State init)
+: rows(rows), cols(cols), stride(cols+2), state((size_t)(rows+2) * (cols+2), State::closed)
 {
-    return lhs.row < rhs.row || (lhs.row == rhs.row && lhs.col < rhs.col);
+    for (int row = 0; row < rows; ++row)
+        std::fill_n(&state[index(row, 0)], cols, init);
 }
 
 
-Growing::Growing(Neighborhood neighborhood)
- : neighborhood(neighborhood)
+Groups::Groups()
+: offsets(1, 0)
 {}
 
-void Growing::post_funct(std::vector<Pixel*>& processed, cv::Mat& data)
+Groups::Groups(const cv::Mat& labels)
 {
-    for (auto& pixel : processed)
+    // range of the values, 16-bit labels use the whole range of the type
+    int min_value = numeric_limits<int_t>::min();
+    int max_value = numeric_limits<int_t>::max();
+    if (labels.depth() == CV_32S && labels.total() > 0)
     {
-        int cls = data.at<int_t>(pixel->row, pixel->col);
-        add_to_group(pixel, cls);
+        double min_label, max_label;
+        cv::minMaxLoc(labels, &min_label, &max_label);
+        min_value = min((int)min_label, 0);
+        max_value = max((int)max_label, 0);
+        if ((int64_t)max_value - min_value > (int64_t)labels.total() + numeric_limits<uint16_t>::max())
+            throw logic_error("Error: Range of 32-bit labels is too large to create groups!");
     }
+    const int64_t offset = -(int64_t)min_value;
+
+    with_label_type(labels.depth(), [&](auto type)
+    {
+        using label_t = decltype(type);
+
+        // 1. count the pixels of each value
+        vector<pixel_idx_t> counts((size_t)(max_value + offset + 1), 0);
+        for (int row = 0; row < labels.rows; ++row)
+        {
+            const label_t* label = labels.ptr<label_t>(row);
+            for (int col = 0; col < labels.cols; ++col)
+                ++counts[label[col] + offset];
+        }
+        counts[offset] = 0;
+
+        // the groups and their offsets, counts are replaced by the position of the next pixel of the group
+        offsets.push_back(0);
+        for (int64_t i = 0; i < (int64_t)counts.size(); ++i)
+        {
+            pixel_idx_t& count = counts[i];
+            if (count == 0)
+                continue;
+            values.push_back((int)(i - offset));
+            pixel_idx_t start = offsets.back();
+            offsets.push_back(start + count);
+            count = start;
+        }
+
+        // 2. place the pixels to the positions of their groups
+        pixels.resize(offsets.back());
+        for (int row = 0; row < labels.rows; ++row)
+        {
+            const label_t* label = labels.ptr<label_t>(row);
+            for (int col = 0; col < labels.cols; ++col)
+                if (label[col] != 0)
+                    pixels[counts[label[col] + offset]++] = (pixel_idx_t)row * labels.cols + col;
+        }
+    });
 }
 
-void Growing::add_to_group(Pixel* pixel, int cls)
+
+NeighborOffsets::NeighborOffsets(int stride)
 {
-    auto it = groups->find(cls);
-    if (it == groups->end())
-        groups->emplace_hint(it, cls, std::vector<Pixel*>(1, pixel)); // not found
-    else
-        it->second.push_back(pixel); //found
+    for (int i = 0; i < n4_size; ++i)
+        n4[i] = (std::ptrdiff_t)n4_rows[i] * stride + n4_cols[i];
+    for (int i = 0; i < n8_size; ++i)
+        n8[i] = (std::ptrdiff_t)n8_rows[i] * stride + n8_cols[i];
 }
-    
 
-void Growing::assign(cv::Mat& data, Pixel* from, Pixel* to)
+
+bool Frontier::advance()
+{
+    current.swap(next);
+    next.clear();
+    return current.size() > 0;
+}
+
+void Frontier::clear()
+{
+    current.clear();
+    next.clear();
+}
+
+
+Growing::Growing(Neighborhood neighborhood)
+ : neighborhood(neighborhood), parallel(false), tile_size(0)
+{}
+
+void Growing::post_funct(std::vector<pixel_idx_t>& processed, cv::Mat& data)
+{}
+
+void Growing::assign(cv::Mat& data, pixel_idx_t from, pixel_idx_t to)
 {
-    data.at<int_t>(to->row, to->col) = data.at<int_t>(from->row, from->col);
+    with_label_type(data.depth(), [&](auto label)
+    {
+        using label_t = decltype(label);
+        label_t* values = data.ptr<label_t>();
+        values[to] = values[from];
+    });
 }
 
-void Growing::assign(cv::Mat& data, int value, Pixel* to)
+void Growing::assign(cv::Mat& data, int value, pixel_idx_t to)
 {
-    data.at<int_t>(to->row, to->col) = value;
+    with_label_type(data.depth(), [&](auto label)
+    {
+        using label_t = decltype(label);
+        data.ptr<label_t>()[to] = (label_t)value;
+    });
 }
 
 
@@ -57,122 +134,67 @@ std::unique_ptr<Groups> Growing::clear_groups()
     return g;
 }
 
-std::unique_ptr<PixelMat> Growing::clear_pixelmat()
+std::unique_ptr<StatePlane> Growing::clear_state_plane()
 {
-    auto c = move(pixel_mat);
-    pixel_mat = nullptr;
+    auto c = move(state_plane);
+    state_plane = nullptr;
     return c;
 }
 
-
-bool Growing::grow_condition(const cv::Mat& input_data, const cv::Mat& data, Pixel* pixel, Pixel* neighbor)
+void Growing::set_parallel(bool parallel)
 {
-    return neighbor->state == State::unseen;   
+    this->parallel = parallel;
 }
 
-size_t Growing::compute(cv::Mat& input_data, cv::Mat& output_data, unique_ptr<Groups>&& groups_init, unique_ptr<PixelMat>&& pixelmat_init)
+void Growing::set_tile_size(int tile_size)
 {
-    cv::Mat data = input_data.clone();
-    if (groups_init == nullptr)
-        groups = make_unique<Groups>();
-    else
-        groups = move(groups_init);
+    this->tile_size = tile_size;
+}
 
-    bool create_new_pixelmat = false;
-    if (pixelmat_init == nullptr)
-        create_new_pixelmat = true;
-    else
-        pixel_mat = move(pixelmat_init);
 
-    size_t steps = compute_inner(data, create_new_pixelmat);
-    output_data = move(data);
-    return steps;
+bool Growing::grow_condition(const cv::Mat& input_data, const cv::Mat& data, pixel_idx_t pixel, pixel_idx_t neighbor)
+{
+    // the kernel checks the state of the neighbor itself
+    return true;
 }
 
-size_t Growing::compute_inner(cv::Mat& data, bool create_new_pixelmat)
+size_t Growing::compute(cv::Mat& input_data, cv::Mat& output_data, unique_ptr<StatePlane>&& state_plane_init)
 {
-    assert(data.depth() == CV_16S);
-
-    bool bool_4_8 = (neighborhood == Neighborhood::n4);
-    set<Pixel*> opened;
-    init_funct(opened, data, create_new_pixelmat);
-    
-    size_t steps = 0;
-
-    vector<Pixel*> processed;
-
-    while (opened.size() > 0)
-    {
-        set<Pixel*> new_pixels;
-        for (auto pixel : opened)
-        {
-            for (auto&& neighbor : get_neighbors(pixel, bool_4_8, data.cols, data.rows))
-                if (grow_condition(data, data, pixel, neighbor))
-                {
-                    new_pixels.insert(neighbor);
-                    assign(data, pixel, neighbor);
-                    neighbor->state = State::opened;
-                }
-            
-            pixel->state = State::closed;
-            processed.push_back(pixel);
-        }
+    cv::Mat data = pad(input_data);
+    bool create_new_state_plane = false;
+    if (state_plane_init == nullptr)
+        create_new_state_plane = true;
+    else
+        state_plane = move(state_plane_init);
 
-        if (neighborhood == Neighborhood::alternating)
-            bool_4_8 = !bool_4_8;
-        
-        opened = move(new_pixels);
-        steps += 1;
-    }
-    post_funct(processed, data);
+    size_t steps = compute_inner(data, create_new_state_plane);
+    output_data = unpad(data);
+    groups = make_unique<Groups>(output_data);
     return steps;
-};
-
-
-vector<Pixel*> Growing::get_neighbors(
-    const Pixel* pixel,
-    bool bool_4_8,
-    size_t cols,
-    size_t rows
-){
-    vector<int> row_delta;
-    vector<int> col_delta;
-    vector<Pixel*> neighbors;
+}
 
-    if (pixel->row == 0)           row_delta = {0,1};
-    else if (pixel->row == rows-1) row_delta = {-1,0};
-    else                          row_delta = {-1,0,1};
+cv::Mat Growing::pad(const cv::Mat& data)
+{
+    cv::Mat padded;
+    cv::copyMakeBorder(data, padded, 1, 1, 1, 1, cv::BORDER_CONSTANT, cv::Scalar(0));
+    return padded;
+}
 
-    if (pixel->col == 0)           col_delta = {0,1};
-    else if (pixel->col == cols-1) col_delta = {-1,0};
-    else                          col_delta = {-1,0,1};
+cv::Mat Growing::unpad(const cv::Mat& padded)
+{
+    return padded(cv::Rect(1, 1, padded.cols-2, padded.rows-2));
+}
 
-    if (bool_4_8)
-    {
-        for (auto r : row_delta)
-        {
-            if (r == 0) continue;
-            Pixel* c = &(*pixel_mat)[pixel->row+r][pixel->col]; 
-            neighbors.push_back(c);
-        }
-        for (auto c : col_delta)
-        {
-            if (c == 0) continue;
-            neighbors.push_back(&(*pixel_mat)[pixel->row][pixel->col+c]);
-        }
-    }
-    else
+size_t Growing::compute_inner(cv::Mat& data, bool create_new_state_plane)
+{
+    VirtualPolicy policy(*this, data);
+    switch (neighborhood)
     {
-        for (auto r : row_delta)
-            for (auto c : col_delta)
-            {
-                if (r == 0 && c == 0) continue;
-                neighbors.push_back(&(*pixel_mat)[pixel->row+r][pixel->col+c]);
-            }
+    case Neighborhood::n4:
+        return compute_with_kernel<Neighborhood4>(data, create_new_state_plane, policy);
+    case Neighborhood::n8:
+        return compute_with_kernel<Neighborhood8>(data, create_new_state_plane, policy);
+    default:
+        return compute_with_kernel<NeighborhoodAlternating>(data, create_new_state_plane, policy);
     }
-
-    return neighbors;
 }
-
-
-
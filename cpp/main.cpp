@@ -33,6 +33,26 @@ void help_exit(const string& message, int exitcode=1)
 }
 
 
+// Options of the computation passed to the voronizer (filled from the command line arguments)
+struct VoronizerOptions
+{
+    VoronoiEngine engine = VoronoiEngine::growing;
+    bool engine_report = false;
+    bool parallel = false;
+    uint tile_size = 0;
+    ColorQuantizer quantizer = ColorQuantizer::kmeans;
+    double sample = default_subsample;
+    double max_drift = default_max_drift;
+    // numbers of colors of kmeans-* modes run instead of N_COLORS (empty for a single run)
+    vector<size_t> sweep;
+    uint seed = 0;
+    KeypointDetector detector = KeypointDetector::sift;
+    uint detection_tile_size = 0;
+    uint detection_max_size = AbstractSIFTVoronizer::default_detection_max_size;
+    bool streaming = false;
+};
+
+
 bool run(
     const string& img_path,
     const string& mode,
@@ -43,7 +63,8 @@ bool run(
     uint smooth,
     const string& output_file,
     uint input_resize,
-    uint output_resize)
+    uint output_resize,
+    const VoronizerOptions& options)
 {
     cv::Mat img = cv::imread(img_path, cv::IMREAD_COLOR);
     if(!img.data)
@@ -75,18 +96,56 @@ bool run(
 
     if (cmap)
         voronizer->set_colormap(cmap_type, random);
-    result = voronizer->run(img); 
-    
-    if (smooth > 0)
-        smoothEdges(result, result, 9, smooth);
-
-    if (output_resize > 0)
-        fitImage(result, result, output_resize);
+    voronizer->set_engine(options.engine, options.engine_report);
+    voronizer->set_parallel(options.parallel);
+    voronizer->set_tile_size((int)options.tile_size);
+    voronizer->set_seed(options.seed);
+    if (auto sift_voronizer = dynamic_cast<AbstractSIFTVoronizer*>(voronizer.get()))
+    {
+        sift_voronizer->set_detector(options.detector);
+        sift_voronizer->set_detection_tiles((int)options.detection_tile_size, (int)options.detection_max_size);
+    }
+    auto kmeans_voronizer = dynamic_cast<AbstractKMeansVoronizer*>(voronizer.get());
+    if (kmeans_voronizer != nullptr)
+    {
+        kmeans_voronizer->set_quantizer(options.quantizer, options.sample, options.max_drift);
+        kmeans_voronizer->set_streaming(options.streaming);
+    }
 
-    if (output_file != "")
-        cv::imwrite(output_file, result);
+    // the sweep gives one result for each number of colors, the output files get the number as a suffix
+    vector<cv::Mat> results;
+    vector<string> suffixes;
+    if (options.sweep.size() > 0)
+    {
+        if (kmeans_voronizer == nullptr)
+            help_exit("The --sweep option is supported only by kmeans-* modes.");
+        results = kmeans_voronizer->runSweep(img, options.sweep);
+        for (size_t n_colors : options.sweep)
+            suffixes.push_back("_" + to_string(n_colors));
+    }
     else
-        imshow(result, "result");
+    {
+        results.push_back(voronizer->run(img));
+        suffixes.push_back("");
+    }
+
+    for (size_t i = 0; i < results.size(); ++i)
+    {
+        result = results[i];
+        if (smooth > 0)
+            smoothEdges(result, result, 9, smooth);
+
+        if (output_resize > 0)
+            fitImage(result, result, output_resize);
+
+        if (output_file != "")
+        {
+            fs::path path(output_file);
+            cv::imwrite((path.parent_path() / (path.stem().string() + suffixes[i] + path.extension().string())).string(), result);
+        }
+        else
+            imshow(result, "result" + suffixes[i]);
+    }
     return true;
 }
 
@@ -157,7 +216,8 @@ int main( int argc, char** argv)
         "\t\t      1. - 3. same as \"kmeans-circles\"\n"
         "\t\t      4. use centers of mass of the regions as endpoints of line segment generators\n"
         "\t\t         - for each point try RANDOM_ITER other (unused) points and select\n"
-        "\t\t         the closest one to create new line segment\n"
+        "\t\t         the closest one to create new line segment (RANDOM_ITER=0 to select\n"
+        "\t\t         the closest of all the unused points, see --seed)\n"
         "\n"
         "\t\t   sift-circles:  arguments ["
                     <<  "KEYPOINT_SIZE_TRESHOLD=" << SIFTVoronizerCircles::default_keypoint_size_treshold
@@ -183,12 +243,115 @@ int main( int argc, char** argv)
         "\t\t      1. - 2. same as \"sift-circles\"\n"
         "\t\t      3. use selected SIFT keypoints as endpoints of line segment generators\n"
         "\t\t         - for each point try RANDOM_ITER other (unused) points and select\n"
-        "\t\t         the closest one to create new line segment\n"
+        "\t\t         the closest one to create new line segment (RANDOM_ITER=0 to select\n"
+        "\t\t         the closest of all the unused points, see --seed)\n"
         "\t\t";
     args.add_argument("-m", "--mode")
         .help(ss.str())
         .default_value<string>("sobel");
 
+    vector<string> engines = {"growing", "edt", "jfa", "1+jfa"};
+    args.add_argument("-e", "--engine")
+        .help("algorithm used to compute the voronoi diagram from generators: " + to_string(engines) + "\n"
+        "\t\t   growing:  region growing alternating 4- and 8-neighborhood (approximation\n"
+        "\t\t      of euclidean distance by octagonal metric)\n"
+        "\t\t   edt:  exact euclidean voronoi diagram computed by parallel distance transform\n"
+        "\t\t   jfa:  approximate euclidean voronoi diagram computed by jump flooding\n"
+        "\t\t   1+jfa:  jump flooding with one additional pass (less errors)")
+        .default_value<string>("growing");
+
+    vector<string> quantizers = {"kmeans", "histogram", "subsample", "hierarchical"};
+    args.add_argument("-q", "--quantizer")
+        .help("algorithm used to quantize the colors in kmeans-* modes: " + to_string(quantizers) + "\n"
+        "\t\t   kmeans:  KMeans clustering of all the pixels\n"
+        "\t\t   histogram:  weighted KMeans clustering of the bins of 15-bit color histogram\n"
+        "\t\t      (much faster on large images, the colors are slightly coarser)\n"
+        "\t\t   subsample:  KMeans clustering of a subsample of the pixels (see --sample), all the\n"
+        "\t\t      pixels are then assigned to the nearest centers\n"
+        "\t\t   hierarchical:  divisive clustering of the bins of 15-bit color histogram (the\n"
+        "\t\t      clusters of any number of colors are nested, see --sweep)")
+        .default_value<string>("kmeans");
+
+    args.add_argument("--sweep")
+        .help("Comma-separated numbers of colors (e.g. \"4,8,16,32\") - kmeans-* modes are run for each of\n"
+        "\t\tthem instead of N_COLORS, but the colors are clustered only once (hierarchically). The\n"
+        "\t\tnumber is added to the name of each output file.")
+        .default_value<string>("");
+
+    args.add_argument("--stream")
+        .help("Label the regions of kmeans-* modes by bands of rows keeping only the regions reaching the last\n"
+        "\t\trow - the regions smaller than CLUSTER_SIZE_TRESHOLD are dropped instead of filled by their\n"
+        "\t\tneighbors, so the generators can be slightly different")
+        .default_value(false)
+        .implicit_value(true);
+
+    args.add_argument("--sample")
+        .help("Size of the subsample of \"subsample\" quantizer - fraction of the pixels if at most 1,\n"
+        "\t\tnumber of pixels otherwise")
+        .default_value(double(default_subsample))
+        .scan<'g', double>();
+
+    args.add_argument("--drift")
+        .help("Tolerance of \"subsample\" quantizer - if the mean colors of the clusters of all the\n"
+        "\t\tpixels drift more from the centers, the centers are refined on all the pixels (negative\n"
+        "\t\tvalue to skip the check)")
+        .default_value(double(default_max_drift))
+        .scan<'g', double>();
+
+    vector<string> detectors = {"sift", "fast", "agast", "gftt", "orb"};
+    args.add_argument("-d", "--detector")
+        .help("detector of the keypoints in sift-* modes: " + to_string(detectors) + "\n"
+        "\t\t   sift:  SIFT keypoints with sizes given by their scale\n"
+        "\t\t   fast, agast, gftt:  corners found by FAST, AGAST or Shi-Tomasi detector, all the\n"
+        "\t\t      keypoints have size 7, so KEYPOINT_SIZE_TRESHOLD is ignored (much faster than SIFT)\n"
+        "\t\t   orb:  ORB keypoints (FAST corners in image pyramid) with sizes given by their scale")
+        .default_value<string>("sift");
+
+    args.add_argument("--detect-tile")
+        .help("Size of tiles for parallel keypoint detection in sift-* modes (0 to detect in the whole\n"
+        "\t\timage at once). The tiles give the keypoints up to --detect-max-size and overlap by the\n"
+        "\t\tneighborhood these keypoints need (the keypoints found twice are merged), the larger\n"
+        "\t\tkeypoints are detected in the downscaled image.")
+        .default_value<uint>(0)
+        .scan<'u', uint>();
+
+    args.add_argument("--detect-max-size")
+        .help("Size of the largest keypoints detected in the tiles of --detect-tile (larger value gives\n"
+        "\t\tmore keypoints the same as without tiles, but larger overlap of the tiles)")
+        .default_value<uint>(AbstractSIFTVoronizer::default_detection_max_size)
+        .scan<'u', uint>();
+
+    args.add_argument("--report")
+        .help("Compute the voronoi diagram also by \"growing\" engine and print the time\n"
+        "\t\tand the differences of the output of the selected engine")
+        .default_value(false)
+        .implicit_value(true);
+
+    args.add_argument("--parallel")
+        .help("Use multi-threaded region labeling and growing - competing generators are resolved\n"
+        "\t\tby the lowest value, so the output is the same for any number of threads (but it\n"
+        "\t\tcan differ from the single-threaded growing)")
+        .default_value(false)
+        .implicit_value(true);
+
+    args.add_argument("--tile")
+        .help("Size of tiles for tiled region growing in \"growing\" engine (0 to grow the whole\n"
+        "\t\timage at once). Implies --parallel - competing generators are resolved by the lowest\n"
+        "\t\tvalue, so the output is the same as with --parallel (and can differ from the default run).")
+        .default_value<uint>(0)
+        .scan<'u', uint>();
+
+    args.add_argument("-t", "--threads")
+        .help("Number of threads used by the parallel computations (0 for OpenCV default)")
+        .default_value<uint>(0)
+        .scan<'u', uint>();
+
+    args.add_argument("--seed")
+        .help("Seed of the order of the points paired with their closest points in *-lines modes\n"
+        "\t\twith RANDOM_ITER=0 (the output is the same for the same seed)")
+        .default_value<uint>(0)
+        .scan<'u', uint>();
+
     args.add_argument("-c", "--colormap")
         .help("OpenCV colormap name to use instead of original image as color template\n" 
         "\t\tor \"bw\" for black & white image: {autumn, bone, jet, winter, rainbow, ocean,\n"
@@ -244,6 +407,7 @@ int main( int argc, char** argv)
     string output_file = args.get("-f");
     uint input_resize = args.get<uint>("-i");
     uint output_resize = args.get<uint>("-o");
+    string engine_name = args.get("-e");
 
     if (!fs::exists(img_path) || fs::is_directory(img_path))
         help_exit("File does not exist: " + img_path);
@@ -251,8 +415,60 @@ int main( int argc, char** argv)
         help_exit("Unrecognized mode: " + mode);
     if (cmap && !strToColormap(args.get<string>("-c"), cmap_type))
         help_exit("Unrecognized colormap: " + args.get<string>("-c"));
+    if (std::find(engines.begin(), engines.end(), engine_name) == engines.end())
+        help_exit("Unrecognized engine: " + engine_name);
+    VoronizerOptions options;
+    if (engine_name == "edt")
+        options.engine = VoronoiEngine::edt;
+    else if (engine_name == "jfa")
+        options.engine = VoronoiEngine::jfa;
+    else if (engine_name == "1+jfa")
+        options.engine = VoronoiEngine::jfa_extra_pass;
+    string quantizer_name = args.get("-q");
+    if (std::find(quantizers.begin(), quantizers.end(), quantizer_name) == quantizers.end())
+        help_exit("Unrecognized quantizer: " + quantizer_name);
+    if (quantizer_name == "histogram")
+        options.quantizer = ColorQuantizer::histogram;
+    else if (quantizer_name == "subsample")
+        options.quantizer = ColorQuantizer::subsample;
+    else if (quantizer_name == "hierarchical")
+        options.quantizer = ColorQuantizer::hierarchical;
+    stringstream sweep_stream(args.get<string>("--sweep"));
+    for (string level; getline(sweep_stream, level, ',');)
+    {
+        size_t n_colors;
+        if (!tryParse(level, n_colors) || n_colors == 0)
+            help_exit("Invalid --sweep number of colors: " + level);
+        options.sweep.push_back(n_colors);
+    }
+    options.sample = args.get<double>("--sample");
+    options.max_drift = args.get<double>("--drift");
+    if (options.sample <= 0)
+        help_exit("Size of the subsample must be positive");
+    string detector_name = args.get("-d");
+    if (std::find(detectors.begin(), detectors.end(), detector_name) == detectors.end())
+        help_exit("Unrecognized detector: " + detector_name);
+    if (detector_name == "fast")
+        options.detector = KeypointDetector::fast;
+    else if (detector_name == "agast")
+        options.detector = KeypointDetector::agast;
+    else if (detector_name == "gftt")
+        options.detector = KeypointDetector::gftt;
+    else if (detector_name == "orb")
+        options.detector = KeypointDetector::orb;
+    options.engine_report = args.get<bool>("--report");
+    options.tile_size = args.get<uint>("--tile");
+    // the tiled growing gives the result of the multi-threaded growing, not of the default one
+    options.parallel = args.get<bool>("--parallel") || options.tile_size > 0;
+    options.seed = args.get<uint>("--seed");
+    options.detection_tile_size = args.get<uint>("--detect-tile");
+    options.detection_max_size = args.get<uint>("--detect-max-size");
+    options.streaming = args.get<bool>("--stream");
+    uint threads = args.get<uint>("-t");
+    if (threads > 0)
+        cv::setNumThreads((int)threads);
 
-    run(img_path, mode, arguments, cmap, cmap_type, random, smooth, output_file, input_resize, output_resize);
+    run(img_path, mode, arguments, cmap, cmap_type, random, smooth, output_file, input_resize, output_resize, options);
 
     return 0;
 }
@@ -3,266 +3,965 @@
 #include <iostream>
 #include <cmath>
 #include <algorithm>
-#include <unordered_set>
 #include <stdexcept>
+#include <atomic>
+#include <limits>
+#include <cstring>
+
+#ifdef _MSC_VER
+    #include <intrin.h>
+#endif
 
 #include <opencv2/imgproc.hpp>
 
 #include "utils.hpp"
+#include "simd.hpp"
 using namespace std;
 
-Separator::Separator(size_t treshold, int bg_value)
-: Growing(Neighborhood::n4), treshold(treshold), bg_value(bg_value), last_row(-1), last_col(-1), n(1), input_data(nullptr)
+LabelEquivalence::LabelEquivalence()
+: parents(1, 0)
+{}
+
+int32_t LabelEquivalence::add()
 {
+    int32_t label = (int32_t)parents.size();
+    parents.push_back(label);
+    return label;
+}
 
+int32_t LabelEquivalence::find(int32_t label)
+{
+    while (parents[label] != label)
+    {
+        parents[label] = parents[parents[label]];
+        label = parents[label];
+    }
+    return label;
 }
 
-void Separator::add_to_group(Pixel* pixel, int cls)
+int32_t LabelEquivalence::merge(int32_t a, int32_t b)
 {
-    auto it = groups->find(cls);
-    if (it == groups->end())
-        groups->emplace_hint(it, cls, std::vector<Pixel*>(1, pixel)); // not found
-    else
-        it->second.push_back(pixel); //found
+    a = find(a);
+    b = find(b);
+    if (a < b)
+        swap(a, b);
+    parents[a] = b;
+    return b;
+}
+
+void LabelEquivalence::flatten()
+{
+    // parent is always smaller than the label, so the parents are already flat when we get to the label
+    for (size_t label = 1; label < parents.size(); ++label)
+        parents[label] = parents[parents[label]];
+}
+
+
+
+// Access to the labels and counts shared by the threads of the parallel labeling (see atomic_state)
+template <typename T>
+static inline atomic<T>& atomic_value(T& value)
+{
+    static_assert(sizeof(atomic<T>) == sizeof(T), "atomic value must have the same size as the value");
+    return reinterpret_cast<atomic<T>&>(value);
 }
 
-void Separator::init_funct(set<Pixel*>& opened, cv::Mat& output, bool init_pixelmat)
+ConcurrentLabelEquivalence::ConcurrentLabelEquivalence(size_t size)
+: parents(size, 0)
+{}
+
+int32_t ConcurrentLabelEquivalence::find(int32_t label)
 {
-    Pixel* pixel = nullptr;
+    int32_t parent = atomic_value(parents[label]).load(memory_order_relaxed);
+    while (parent != label)
+    {
+        // path halving - the grandparent stays an ancestor even if the entry was changed by other thread meanwhile
+        int32_t grandparent = atomic_value(parents[parent]).load(memory_order_relaxed);
+        atomic_value(parents[label]).compare_exchange_weak(parent, grandparent, memory_order_relaxed);
+        label = grandparent;
+        parent = atomic_value(parents[label]).load(memory_order_relaxed);
+    }
+    return label;
+}
 
-    // Find a pixel with negative value that we will start growing from
-    // (restore searching from pixel used in previous iteration instead always starting from zero)
-    for (int col = last_col+1; col < output.cols; ++col)
+int32_t ConcurrentLabelEquivalence::merge(int32_t a, int32_t b)
+{
+    while (true)
     {
-        if (output.at<int_t>(last_row,col) < 0)
-        {
-            pixel = &(*pixel_mat)[last_row][col];
-            last_col = col;
-            break;
-        }
+        a = find(a);
+        b = find(b);
+        if (a == b)
+            return a;
+        if (a < b)
+            swap(a, b);
+        // link the larger root under the smaller one, fails if the larger root was linked by other thread meanwhile
+        int32_t expected = a;
+        if (atomic_value(parents[a]).compare_exchange_strong(expected, b))
+            return b;
     }
-    if (pixel == nullptr)
-        for (int row = last_row+1; row < output.rows; ++row)
+}
+
+
+// First pass of the labeling of rows [begin, end) - every pixel takes the provisional label of its left or upper
+// neighbor with the same key, new labels are created by new_label(pixel) and every labeled pixel is passed to
+// add_pixel(label, row, col) (to accumulate the stats). The labels overwrite the keys, so the keys of the previous row
+// are kept in up_keys (it must contain the keys of the row above the first row, after the call it contains the keys
+// of the last row).
+template <typename Equivalence, typename NewLabel, typename AddPixel>
+static void label_rows(int32_t* values, const StatePlane& states, int begin, int end, vector<int32_t>& up_keys,
+    Equivalence& equivalence, NewLabel new_label, AddPixel add_pixel)
+{
+    vector<int32_t> keys(states.stride, 0);
+    for (int row = begin; row < end; ++row)
+    {
+        int32_t* labels = values + states.index(row, -1);
+        copy_n(labels, states.stride, keys.begin());
+        for (int col = 1; col <= states.cols; ++col)
         {
-            for (int col = 0; col < output.cols; ++col)
+            int32_t key = keys[col];
+            if (key >= 0)
             {
-                if (output.at<int_t>(row,col) < 0)
-                {
-                    pixel = &(*pixel_mat)[row][col];
-                    last_row = row;
-                    last_col = col;
-                    break;
-                }
+                labels[col] = 0;
+                continue;
             }
 
-            if (pixel != nullptr) break; 
+            int32_t left = (keys[col-1] == key ? labels[col-1] : 0);
+            int32_t up = (up_keys[col] == key ? labels[col - states.stride] : 0);
+            int32_t label;
+            if (left != 0 && up != 0)
+                label = (left == up ? left : equivalence.merge(left, up));
+            else if (left != 0 || up != 0)
+                label = left + up;
+            else
+                label = new_label((pixel_idx_t)(labels + col - values));
+            labels[col] = label;
+            add_pixel(label, row, col-1);
         }
-    if (pixel == nullptr) return;
+        keys.swap(up_keys);
+    }
+}
+
+
+
+// Rows of the labeling are processed in bands of this height (parallel labeling and relabeling)
+static constexpr int band_rows = 64;
 
-    // Open the found pixel and assign it new area id
-    pixel->state = State::opened;
-    assign(output, n, pixel);
-    opened.insert(pixel);
+/*
+Row kernels of the relabeling - replace the labels of 'size' pixels by the values of the lookup table.
+All kernels give the same results.
+*/
+typedef void (*lut_row_funct_t)(int32_t* values, const int32_t* lut, int size);
+
+static void lut_row_scalar(int32_t* values, const int32_t* lut, int size)
+{
+    for (int i = 0; i < size; ++i)
+        values[i] = lut[values[i]];
 }
 
-void Separator::post_funct(std::vector<Pixel*>& processed, cv::Mat& output)
+#ifdef VORONIZER_AVX2
+VORONIZER_TARGET("avx2")
+static void lut_row_avx2(int32_t* values, const int32_t* lut, int size)
 {
-    if (processed.size() < treshold)
+    int i = 0;
+    for (; i + 8 <= size; i += 8)
     {
-        for (auto pixel : processed)
+        __m256i labels = _mm256_loadu_si256((const __m256i*)(values + i));
+        _mm256_storeu_si256((__m256i*)(values + i), _mm256_i32gather_epi32((const int*)lut, labels, 4));
+    }
+    lut_row_scalar(values + i, lut, size - i);
+}
+#endif
+
+// Select the widest kernel supported by the CPU
+static lut_row_funct_t select_lut_row_funct()
+{
+#ifdef VORONIZER_AVX2
+    if (cv::checkHardwareSupport(CV_CPU_AVX2))
+        return lut_row_avx2;
+#endif
+    return lut_row_scalar;
+}
+
+
+
+Separator::Separator(size_t treshold, int bg_value)
+: Growing(Neighborhood::n4), treshold(treshold), bg_value(bg_value), build_groups(true)
+{
+
+}
+
+void Separator::set_build_groups(bool build_groups)
+{
+    this->build_groups = build_groups;
+}
+
+void Separator::init_funct(Frontier& opened, cv::Mat& data, bool create_new_state_plane)
+{
+    if (create_new_state_plane == true)
+        throw logic_error(
+            string(nameof(Separator))
+            .append(" doesn't support call of ")
+            .append(nameof(init_funct))
+            .append(" with ")
+            .append(nameof(create_new_state_plane))
+            .append(" == True!")
+        );
+
+    StatePlane& states = *state_plane;
+    const NeighborOffsets offsets(states.stride);
+    const int32_t* values = data.ptr<int32_t>();
+
+    // the state plane serves as the bitmap of the removed pixels
+    for (auto x : removed)
+        states[states.from_image_index(x)] = State::unseen;
+
+    // open the labeled neighbors of the removed pixels (in the order of the removed pixels, so the result
+    // is deterministic), the pixels of the padding and the background are zero, so they are never opened
+    for (auto x : removed)
+    {
+        pixel_idx_t pixel = states.from_image_index(x);
+        for (auto offset = offsets.begin(true); offset != offsets.end(true); ++offset)
         {
-            assign(output, 0, pixel);
-            add_to_group(pixel, 0);
+            pixel_idx_t neighbor = (pixel_idx_t)(pixel + *offset);
+            if (values[neighbor] != 0 && states[neighbor] == State::closed)
+            {
+                states[neighbor] = State::opened;
+                opened.open(neighbor);
+            }
         }
     }
+}
+
+size_t Separator::compute_inner(cv::Mat& data, bool create_new_state_plane)
+{
+    // the labeling doesn't use the state plane, all the pixels are marked as 'closed' for the filling
+    if (create_new_state_plane)
+        state_plane = make_unique<StatePlane>(data.rows-2, data.cols-2, State::closed);
     else
+        for (int row = 0; row < state_plane->rows; ++row)
+            fill_n(&(*state_plane)[state_plane->index(row, 0)], state_plane->cols, State::closed);
+
+    size_t regions = (parallel ? label_regions_parallel(data) : label_regions(data));
+
+    // grow the neighboring regions into the areas of the removed regions and add the filled pixels to their stats
+    if (removed.size() > 0)
     {
-        for (auto pixel : processed)
-            add_to_group(pixel, n);
+        compute_with_kernel<Neighborhood4>(data, false, GrowToUnseen());
+        const int32_t* values = data.ptr<int32_t>();
+        for (auto x : removed)
+        {
+            int32_t id = values[state_plane->from_image_index(x)];
+            if (id > 0)
+                stats[id-1].add((int)(x / state_plane->cols), (int)(x % state_plane->cols));
+        }
     }
+    return regions;
 }
 
+void Separator::relabel(cv::Mat& data, const int32_t* lut, bool collect_removed)
+{
+    static const lut_row_funct_t relabel_row = select_lut_row_funct();
+    const StatePlane& states = *state_plane;
+    int32_t* values = data.ptr<int32_t>();
+    const int n_bands = (states.rows + band_rows - 1) / band_rows;
+
+    // the padding stays zero, so only the columns of the image are relabeled, the removed pixels are collected
+    // while the row is still in the cache
+    vector<vector<pixel_idx_t>> removed_in_band(n_bands);
+    cv::parallel_for_(cv::Range(0, n_bands), [&](const cv::Range& range)
+    {
+        for (int band = range.start; band < range.end; ++band)
+        {
+            int end = min(states.rows, (band + 1) * band_rows);
+            for (int row = band * band_rows; row < end; ++row)
+            {
+                int32_t* row_values = values + states.index(row, 0);
+                relabel_row(row_values, lut, states.cols);
+                if (!collect_removed)
+                    continue;
+                for (int col = 0; col < states.cols; ++col)
+                    if (row_values[col] == removed_id)
+                    {
+                        row_values[col] = 0;
+                        removed_in_band[band].push_back((pixel_idx_t)row * states.cols + col);
+                    }
+            }
+        }
+    });
+    for (auto& band_removed : removed_in_band)
+        removed.insert(removed.end(), band_removed.begin(), band_removed.end());
+}
 
-bool Separator::grow_condition(const cv::Mat& input_data, const cv::Mat& data, Pixel* pixel, Pixel* neighbor)
+vector<int32_t> Separator::region_ids(LabelEquivalence& equivalence, vector<RegionStats>& label_stats)
 {
-    return (neighbor->state == State::unseen) && (this->input_data->at<int_t>(pixel->row,pixel->col) == this->input_data->at<int_t>(neighbor->row, neighbor->col));   
+    // resolve the equivalences and sum up the stats of the regions in the roots
+    // (roots are ordered by the first pixel of the region, so the ids are given in raster order)
+    equivalence.flatten();
+    const vector<int32_t>& roots = equivalence.parents;
+    vector<int32_t> ids(equivalence.size(), 0);
+    for (size_t label = 1; label < roots.size(); ++label)
+        if (roots[label] != (int32_t)label)
+            label_stats[roots[label]].add(label_stats[label]);
+    stats.clear();
+    for (size_t label = 1; label < roots.size(); ++label)
+    {
+        if (roots[label] != (int32_t)label)
+            ids[label] = ids[roots[label]];
+        else if (label_stats[label].size >= treshold)
+        {
+            stats.push_back(label_stats[label]);
+            ids[label] = (int32_t)stats.size();
+        }
+        else
+            ids[label] = removed_id;
+    }
+    return ids;
 }
 
+size_t Separator::label_regions(cv::Mat& data)
+{
+    const StatePlane& states = *state_plane;
+    int32_t* values = data.ptr<int32_t>();
+
+    // 1. assign provisional labels (labels are numbered from one in the order of creation)
+    LabelEquivalence equivalence;
+    vector<RegionStats> label_stats(1);
+    vector<int32_t> up_keys(states.stride, 0);
+    label_rows(values, states, 0, states.rows, up_keys, equivalence,
+        [&](pixel_idx_t pixel)
+        {
+            label_stats.emplace_back();
+            return equivalence.add();
+        },
+        [&](int32_t label, int row, int col) { label_stats[label].add(row, col); });
 
+    // 2. give ids to the regions that are large enough
+    vector<int32_t> ids = region_ids(equivalence, label_stats);
 
-size_t Separator::compute(cv::Mat& input_data, cv::Mat& output_data,std::unique_ptr<Groups>&& groups_init, std::unique_ptr<PixelMat>&& pixelmat_init)
-{
-    if (groups == nullptr)
-        this->groups = make_unique<Groups>();
-    else
-        this->groups = move(groups_init);
-    
-    bool create_new_pixelmat = false;
-    if (pixelmat_init == nullptr)
-        create_new_pixelmat = true;
-    else
-        pixel_mat = move(pixelmat_init);
+    // 3. assign the ids
+    relabel(data, ids.data(), find(ids.begin(), ids.end(), removed_id) != ids.end());
 
-    cv::Mat data = input_data.clone();
-    this->input_data = &input_data;
-    this->last_row = 0;
-    this->last_col = 0;
+    return stats.size();
+}
 
-    // Transform the data in a way that the background value is zero and there are no pixels with 
-    // positive values (so we can assign them positive values in following iterations) 
-    if (bg_value != 0)
-        for (int row = 0; row < data.rows; ++row)
-            for (int col = 0; col < data.cols; ++col)
+size_t Separator::label_regions_parallel(cv::Mat& data)
+{
+    if (data.total() > (size_t)numeric_limits<int32_t>::max())
+        throw logic_error("Error: Image is too large to be labeled in parallel!");
+
+    const StatePlane& states = *state_plane;
+    int32_t* values = data.ptr<int32_t>();
+    const int n_bands = (states.rows + band_rows - 1) / band_rows;
+
+    // Labels are the indices of the pixels where they were created and the labels created by each band are listed
+    // in created (in increasing order), their stats are stored in band_stats at the same position - the position
+    // is stored in label_slots (indexed by the labels, i.e. by the pixels) and later replaced by the id
+    ConcurrentLabelEquivalence equivalence(data.total());
+    vector<pixel_idx_t> label_slots(data.total());
+    vector<vector<int32_t>> created(n_bands);
+    vector<vector<RegionStats>> band_stats(n_bands);
+    // keys of the first and the last row of each band, needed to merge the labels across the seams
+    vector<vector<int32_t>> first_keys(n_bands), last_keys(n_bands);
+
+    // 1. assign provisional labels in each band independently
+    cv::parallel_for_(cv::Range(0, n_bands), [&](const cv::Range& range)
+    {
+        for (int band = range.start; band < range.end; ++band)
+        {
+            int begin = band * band_rows;
+            int end = min(states.rows, begin + band_rows);
+            const int32_t* first_row = values + states.index(begin, -1);
+            first_keys[band].assign(first_row, first_row + states.stride);
+            vector<int32_t> up_keys(states.stride, 0);
+            label_rows(values, states, begin, end, up_keys, equivalence,
+                [&](pixel_idx_t pixel)
+                {
+                    equivalence.add((int32_t)pixel);
+                    label_slots[pixel] = (pixel_idx_t)created[band].size();
+                    created[band].push_back((int32_t)pixel);
+                    band_stats[band].emplace_back();
+                    return (int32_t)pixel;
+                },
+                [&](int32_t label, int row, int col) { band_stats[band][label_slots[label]].add(row, col); });
+            last_keys[band].swap(up_keys);
+        }
+    });
+
+    // 2. merge the labels of the pixels with the same key across the seams
+    if (n_bands > 1)
+        cv::parallel_for_(cv::Range(1, n_bands), [&](const cv::Range& range)
+        {
+            for (int band = range.start; band < range.end; ++band)
             {
-                int_t value = data.at<int_t>(row,col);
+                const int32_t* labels = values + states.index(band * band_rows, -1);
+                const int32_t* up_labels = labels - states.stride;
+                const vector<int32_t>& keys = first_keys[band];
+                const vector<int32_t>& up_keys = last_keys[band-1];
+                for (int col = 1; col <= states.cols; ++col)
+                {
+                    int32_t key = keys[col];
+                    // the pair of the left pixels is already merged in the same sets
+                    if (key >= 0 || up_keys[col] != key || (keys[col-1] == key && up_keys[col-1] == key))
+                        continue;
+                    equivalence.merge(labels[col], up_labels[col]);
+                }
+            }
+        });
 
-                if (value > bg_value)
-                    data.at<int_t>(row,col) = -value;
+    // 3. point the labels directly to their roots and sum up the stats of the regions in the roots,
+    // the stats of labels with the root in other band are summed up afterwards by one thread (there are only
+    // few of them, as the regions can cross the bands only at the seams)
+    vector<vector<size_t>> crossing(n_bands);
+    cv::parallel_for_(cv::Range(0, n_bands), [&](const cv::Range& range)
+    {
+        for (int band = range.start; band < range.end; ++band)
+        {
+            const int32_t band_begin = (int32_t)states.index(band * band_rows, -1);
+            for (size_t i = 0; i < created[band].size(); ++i)
+            {
+                int32_t label = created[band][i];
+                int32_t root = equivalence.find(label);
+                if (root == label)
+                    continue;
+                atomic_value(equivalence.parents[label]).store(root, memory_order_relaxed);
+                if (root >= band_begin)
+                    band_stats[band][label_slots[root]].add(band_stats[band][i]);
                 else
-                    data.at<int_t>(row,col) = value - bg_value;
+                    crossing[band].push_back(i);
             }
-    else
-        data = -data; 
-
+        }
+    });
+    const vector<int32_t>& roots = equivalence.parents;
+    for (int band = 0; band < n_bands; ++band)
+        for (size_t i : crossing[band])
+        {
+            int32_t root = roots[created[band][i]];
+            band_stats[states.row(root) / band_rows][label_slots[root]].add(band_stats[band][i]);
+        }
 
-    if (create_new_pixelmat)
+    // 4. count the regions that are large enough in each band to find the first id of each band
+    vector<size_t> first_ids(n_bands + 1, 0);
+    cv::parallel_for_(cv::Range(0, n_bands), [&](const cv::Range& range)
     {
-        // First initialization of pixel_mat
-        pixel_mat = make_unique<PixelMat>(
-            data.rows, vector<Pixel>(
-            data.cols, Pixel(0, 0, State::unseen))
-        );
-    }
-    for (int row = 0; row < data.rows; ++row)
-        for (int col = 0; col < data.cols; ++col)
+        for (int band = range.start; band < range.end; ++band)
+            for (size_t i = 0; i < created[band].size(); ++i)
+                if (roots[created[band][i]] == created[band][i] && band_stats[band][i].size >= treshold)
+                    ++first_ids[band+1];
+    });
+    for (int band = 0; band < n_bands; ++band)
+        first_ids[band+1] += first_ids[band];
+
+    // 5. give ids to the regions (roots are ordered by the first pixel of the region, so the ids are given in raster
+    // order), the slots of the roots are replaced by the ids
+    stats.resize(first_ids[n_bands]);
+    vector<char> any_removed(n_bands, false);
+    cv::parallel_for_(cv::Range(0, n_bands), [&](const cv::Range& range)
+    {
+        for (int band = range.start; band < range.end; ++band)
         {
-            Pixel& c = (*pixel_mat)[row][col];
-            if (create_new_pixelmat)
+            size_t id = first_ids[band];
+            for (size_t i = 0; i < created[band].size(); ++i)
             {
-                c.row = row;
-                c.col = col;
+                int32_t label = created[band][i];
+                if (roots[label] != label)
+                    continue;
+                if (band_stats[band][i].size >= treshold)
+                {
+                    stats[id] = band_stats[band][i];
+                    label_slots[label] = (pixel_idx_t)++id;
+                }
+                else
+                {
+                    label_slots[label] = (pixel_idx_t)removed_id;
+                    any_removed[band] = true;
+                }
             }
+        }
+    });
+
+    // 6. the other labels take the ids of their roots, so label_slots become the lookup table of the ids
+    // (label 0 is never created, so it stays zero for the background)
+    cv::parallel_for_(cv::Range(0, n_bands), [&](const cv::Range& range)
+    {
+        for (int band = range.start; band < range.end; ++band)
+            for (int32_t label : created[band])
+                if (roots[label] != label)
+                    label_slots[label] = label_slots[roots[label]];
+    });
+
+    // 7. assign the ids
+    bool collect_removed = find(any_removed.begin(), any_removed.end(), true) != any_removed.end();
+    relabel(data, reinterpret_cast<const int32_t*>(label_slots.data()), collect_removed);
+
+    return stats.size();
+}
+
 
-            c.state = (data.at<int_t>(row,col) < 0 ?
-                State::unseen : State::closed);
+
+size_t Separator::compute(cv::Mat& input_data, cv::Mat& output_data, std::unique_ptr<StatePlane>&& state_plane_init)
+{
+    removed.clear();
+    bool create_new_state_plane = false;
+    if (state_plane_init == nullptr)
+        create_new_state_plane = true;
+    else
+        state_plane = move(state_plane_init);
+
+    // The data are padded, so they can be addressed by the indices of state_plane,
+    // the regions are labeled by 32-bit ids (the output is converted to 16-bit if there are not too many regions)
+    cv::Mat data;
+    pad(input_data).convertTo(data, CV_32S);
+
+    // Transform the data in a way that the background value is zero and there are no pixels with 
+    // positive values (so the ids of the regions can be assigned as positive values)
+    int32_t* values = data.ptr<int32_t>();
+    for (int row = 1; row < data.rows-1; ++row)
+        for (int col = 1; col < data.cols-1; ++col)
+        {
+            pixel_idx_t pixel = (pixel_idx_t)row * data.cols + col;
+            values[pixel] = region_key(values[pixel], bg_value);
         }
-    
-    this->n = 1;
-    size_t steps = 0;
-    while (true)
+
+    size_t regions = compute_inner(data, create_new_state_plane);
+
+    // the ids are already continuous, the filling only extends the regions
+    cv::Mat output = unpad(data);
+    groups = (build_groups ? make_unique<Groups>(output) : nullptr);
+
+    if (label_depth((int64_t)stats.size()) == CV_16S)
+        output.convertTo(output, CV_16S);
+
+    output_data = output;
+    return regions;
+}
+
+
+
+StreamingSeparator::StreamingSeparator(int cols, component_funct_t component_funct, size_t treshold, int bg_value)
+: cols(cols), component_funct(component_funct), treshold(treshold), bg_value(bg_value), row(0), n(0),
+  up_labels(cols + 2, 0), up_keys(cols + 2, 0), stats(1), values(1, 0), row_labels(cols + 2, 0), row_keys(cols + 2, 0)
+{}
+
+void StreamingSeparator::push(const cv::Mat& rows)
+{
+    // with_label_type would read any other depth as 16-bit labels
+    CV_Assert(rows.depth() == CV_16S || rows.depth() == CV_32S);
+    if (rows.cols != cols || rows.channels() != 1)
+        throw logic_error("Error: Rows pushed to StreamingSeparator must have the same number of columns as the image!");
+
+    with_label_type(rows.depth(), [&](auto label)
+    {
+        for (int r = 0; r < rows.rows; ++r)
+            push_row(rows.ptr<decltype(label)>(r));
+    });
+}
+
+template <typename label_t>
+void StreamingSeparator::push_row(const label_t* row_values)
+{
+    // 1. assign provisional labels as Separator does, the labels of the last row are the roots of their regions
+    vector<int32_t>& keys = row_keys;
+    vector<int32_t>& labels = row_labels;
+    fill(labels.begin(), labels.end(), 0);
+    for (int col = 1; col <= cols; ++col)
     {
-        size_t s = Growing::compute_inner(data, false);
-        ++n;
-        steps += s;
-        if (s == 0)
-            break;
+        int32_t key = region_key(row_values[col-1], bg_value);
+        keys[col] = key;
+        if (key >= 0)
+            continue;
+
+        int32_t left = (keys[col-1] == key ? labels[col-1] : 0);
+        int32_t up = (up_keys[col] == key ? up_labels[col] : 0);
+        int32_t label;
+        if (left != 0 && up != 0)
+            label = (left == up ? left : equivalence.merge(left, up));
+        else if (left != 0 || up != 0)
+            label = left + up;
+        else
+        {
+            label = equivalence.add();
+            stats.emplace_back();
+            values.push_back(row_values[col-1]);
+        }
+        labels[col] = label;
+        stats[label].add(row, col-1);
     }
 
-    // Grow pixels after removing areas with #pixels < trehold
-    if (treshold > 0)
+    // 2. sum up the stats in the roots
+    equivalence.flatten();
+    const vector<int32_t>& roots = equivalence.parents;
+    for (size_t label = 1; label < roots.size(); ++label)
+        if (roots[label] != (int32_t)label)
+            stats[roots[label]].add(stats[label]);
+
+    // 3. the regions reaching this row get new continuous labels (in the order of their pixels in this row)
+    new_labels.assign(roots.size(), 0);
+    new_stats.resize(1);
+    new_values.resize(1);
+    for (int col = 1; col <= cols; ++col)
     {
-        auto tg = AfterTresholdGrowing(input_data.rows, input_data.cols);
-        tg.compute(data, data, move(groups), move(pixel_mat));
-        groups = tg.clear_groups();
-        pixel_mat = tg.clear_pixelmat();
+        if (labels[col] == 0)
+            continue;
+        int32_t root = roots[labels[col]];
+        if (new_labels[root] == 0)
+        {
+            new_labels[root] = (int32_t)new_stats.size();
+            new_stats.push_back(stats[root]);
+            new_values.push_back(values[root]);
+        }
+        labels[col] = new_labels[root];
     }
-    
 
-    this->input_data = nullptr;
-    output_data = move(data);
-    return steps;
+    // 4. the other regions are finished
+    for (size_t label = 1; label < roots.size(); ++label)
+        if (roots[label] == (int32_t)label && new_labels[label] == 0)
+            emit((int32_t)label);
+
+    equivalence.parents.resize(1);
+    for (size_t label = 1; label < new_stats.size(); ++label)
+        equivalence.add();
+    stats.swap(new_stats);
+    values.swap(new_values);
+    up_labels.swap(labels);
+    up_keys.swap(keys);
+    ++row;
 }
 
+void StreamingSeparator::emit(int32_t label)
+{
+    if (stats[label].size >= treshold)
+        component_funct(Component{++n, values[label], stats[label]});
+}
+
+void StreamingSeparator::finish()
+{
+    // after the last row, all the labels are roots
+    for (size_t label = 1; label < stats.size(); ++label)
+        emit((int32_t)label);
+
+    row = 0;
+    n = 0;
+    fill(up_labels.begin(), up_labels.end(), 0);
+    fill(up_keys.begin(), up_keys.end(), 0);
+    equivalence = LabelEquivalence();
+    stats.assign(1, RegionStats());
+    values.assign(1, 0);
+}
 
 
-Separator::AfterTresholdGrowing::AfterTresholdGrowing(int rows, int cols)
-: Growing(Neighborhood::n4), rows(rows), cols(cols)
-{}
 
-void Separator::AfterTresholdGrowing::init_funct(set<Pixel*>& opened, cv::Mat& output, bool create_new_pixelmat)
+// Index of the lowest set bit of non-zero word
+static inline int lowest_bit(uint64_t word)
 {
-    if (create_new_pixelmat == true)
-        throw logic_error(
-            string(nameof(AfterTresholdGrowing))
-            .append(" doesn't support call of ")
-            .append(nameof(init_funct))
-            .append(" with ")
-            .append(nameof(create_new_pixelmat))
-            .append(" == True!")
-        );
+#ifdef _MSC_VER
+    unsigned long index;
+    _BitScanForward64(&index, word);
+    return (int)index;
+#else
+    return __builtin_ctzll(word);
+#endif
+}
 
-    bool bool_4_8 = (neighborhood == Neighborhood::n4);
+// Packs 8 pixels to 8 bits, bit i is set if the i-th pixel is non-zero (expects little-endian byte order)
+static inline uint64_t pack_pixels(const uchar* pixels)
+{
+    uint64_t x;
+    memcpy(&x, pixels, sizeof(x));
+    // set the highest bit of every non-zero byte and gather these bits to the highest byte by multiplication
+    uint64_t high = (((x & 0x7F7F7F7F7F7F7F7Full) + 0x7F7F7F7F7F7F7F7Full) | x) & 0x8080808080808080ull;
+    return (high * 0x0002040810204081ull) >> 56;
+}
 
-    // Find the border of "background" pixels
-    auto it = groups->find(0);
-    if (it != groups->end())
+// Index of the first bit with given value at or after 'from' in the row of 'size' bits (or size if there is none)
+static int find_bit(const vector<uint64_t>& words, int size, int from, bool value)
+{
+    size_t k = from / 64;
+    uint64_t word = (value ? words[k] : ~words[k]) & (~0ull << (from % 64));
+    while (word == 0)
+    {
+        if (++k == words.size())
+            return size;
+        word = (value ? words[k] : ~words[k]);
+    }
+    return min(size, (int)k * 64 + lowest_bit(word));
+}
+
+
+BinarySeparator::BinarySeparator(size_t treshold)
+: Separator(treshold, 0)
+{}
+
+void BinarySeparator::find_runs(const cv::Mat& data, vector<vector<Run>>& runs)
+{
+    runs.resize(data.rows);
+    cv::parallel_for_(cv::Range(0, data.rows), [&](const cv::Range& range)
     {
-        auto bg = unordered_set<Pixel*>();
-        bg.reserve(it->second.size());
-        for (auto& x : it->second)
-            bg.insert(x);
-        
-        for (auto& pixel : it->second)
+        vector<uint64_t> words((data.cols + 63) / 64);
+        for (int row = range.start; row < range.end; ++row)
         {
-            for (auto& neighbor : get_neighbors(pixel, bool_4_8, cols, rows))
+            // pack the row by 8 pixels (the bits after the end of the row stay zero)
+            const uchar* pixels = data.ptr<uchar>(row);
+            fill(words.begin(), words.end(), 0);
+            int col = 0;
+            for (; col + 8 <= data.cols; col += 8)
+                words[col / 64] |= pack_pixels(pixels + col) << (col % 64);
+            for (; col < data.cols; ++col)
+                words[col / 64] |= (uint64_t)(pixels[col] != 0) << (col % 64);
+
+            runs[row].clear();
+            int begin = find_bit(words, data.cols, 0, true);
+            while (begin < data.cols)
             {
-                auto c_it = bg.find(neighbor);
-                if (c_it != bg.end())
+                int end = find_bit(words, data.cols, begin, false);
+                runs[row].push_back({begin, end, 0});
+                begin = (end < data.cols ? find_bit(words, data.cols, end, true) : data.cols);
+            }
+        }
+    });
+}
+
+vector<int32_t> BinarySeparator::label_runs(vector<vector<Run>>& runs)
+{
+    // assign provisional labels to the runs - the run takes the label of the overlapping runs of the previous row
+    LabelEquivalence equivalence;
+    vector<RegionStats> label_stats(1);
+    for (size_t row = 0; row < runs.size(); ++row)
+    {
+        size_t up = 0;
+        for (Run& run : runs[row])
+        {
+            int32_t label = 0;
+            if (row > 0)
+            {
+                const vector<Run>& up_runs = runs[row-1];
+                // skip the runs ending before this run, all the following runs starting before its end overlap it
+                // (the last of them can overlap the next run too, so it is not skipped)
+                while (up < up_runs.size() && up_runs[up].end <= run.begin)
+                    ++up;
+                for (size_t i = up; i < up_runs.size() && up_runs[i].begin < run.end; ++i)
                 {
-                    (**c_it).state = State::opened;
-                    opened.insert(pixel);
+                    if (label == 0)
+                        label = up_runs[i].label;
+                    else if (label != up_runs[i].label)
+                        label = equivalence.merge(label, up_runs[i].label);
                 }
-
             }
+            if (label == 0)
+            {
+                label = equivalence.add();
+                label_stats.emplace_back();
+            }
+            run.label = label;
+            label_stats[label].add_run((int)row, run.begin, run.end);
         }
     }
-    
+    return region_ids(equivalence, label_stats);
 }
 
-void Separator::AfterTresholdGrowing::remap(cv::Mat& data)
+vector<int32_t> BinarySeparator::label_runs_parallel(vector<vector<Run>>& runs)
 {
-    if (groups->size() == 0)
-        return;
-
-    unique_ptr<Groups> g = make_unique<Groups>();
-    auto it = groups->begin();
-    
-    if (it->first < 0)
-        throw logic_error("Error: Found negative group id!");
-    
-    if (it->first == 0)
+    const int rows = (int)runs.size();
+    const int n_bands = (rows + band_rows - 1) / band_rows;
+
+    // Labels are the indices of the runs in raster order (from one), so the labels of each band form a continuous
+    // range and the root of each region is the label of its first run, as in the single-threaded labeling
+    vector<int32_t> first_labels(rows + 1, 1);
+    size_t n_labels = 1;
+    for (int row = 0; row < rows; ++row)
     {
-        (*g)[it->first] = move(it->second);
-        ++it;
+        n_labels += runs[row].size();
+        if (n_labels > (size_t)numeric_limits<int32_t>::max())
+            throw logic_error("Error: Image is too large to be labeled in parallel!");
+        first_labels[row+1] = (int32_t)n_labels;
     }
+    ConcurrentLabelEquivalence equivalence(n_labels);
 
-    int n = 1;
-    while (it != groups->end())
+    // unites the runs of the row with the overlapping runs of the previous row (see label_runs)
+    auto link_rows = [&](int row)
     {
-        if (it->first != n)
+        const vector<Run>& up_runs = runs[row-1];
+        size_t up = 0;
+        for (const Run& run : runs[row])
         {
-            (*g)[n] = move(it->second);
-            ++n;
+            while (up < up_runs.size() && up_runs[up].end <= run.begin)
+                ++up;
+            for (size_t i = up; i < up_runs.size() && up_runs[i].begin < run.end; ++i)
+                equivalence.merge(run.label, up_runs[i].label);
         }
-        ++it;
-    }
-    swap(this->groups, g);
+    };
 
-    for (auto& iter : *groups)
-        if (iter.first != data.at<int16_t>(iter.second[0]->row, iter.second[0]->col))
-            for (auto& c : iter.second)
-                assign(data, iter.first, c);
+    // 1. label the runs and unite them in each band independently
+    cv::parallel_for_(cv::Range(0, n_bands), [&](const cv::Range& range)
+    {
+        for (int band = range.start; band < range.end; ++band)
+        {
+            int begin = band * band_rows;
+            int end = min(rows, begin + band_rows);
+            for (int row = begin; row < end; ++row)
+            {
+                for (size_t i = 0; i < runs[row].size(); ++i)
+                {
+                    runs[row][i].label = first_labels[row] + (int32_t)i;
+                    equivalence.add(runs[row][i].label);
+                }
+                if (row > begin)
+                    link_rows(row);
+            }
+        }
+    });
 
+    // 2. unite the runs across the seams
+    if (n_bands > 1)
+        cv::parallel_for_(cv::Range(1, n_bands), [&](const cv::Range& range)
+        {
+            for (int band = range.start; band < range.end; ++band)
+                link_rows(band * band_rows);
+        });
+
+    // 3. point the labels directly to their roots and sum up the stats of the regions in the roots, the runs with
+    // the root in other band are summed up afterwards by one thread (as in Separator::label_regions_parallel)
+    vector<RegionStats> label_stats(n_labels);
+    vector<vector<pair<int, const Run*>>> crossing(n_bands);
+    cv::parallel_for_(cv::Range(0, n_bands), [&](const cv::Range& range)
+    {
+        for (int band = range.start; band < range.end; ++band)
+        {
+            int begin = band * band_rows;
+            int end = min(rows, begin + band_rows);
+            for (int row = begin; row < end; ++row)
+                for (const Run& run : runs[row])
+                {
+                    int32_t root = equivalence.find(run.label);
+                    if (root != run.label)
+                        atomic_value(equivalence.parents[run.label]).store(root, memory_order_relaxed);
+                    if (root >= first_labels[begin])
+                        label_stats[root].add_run(row, run.begin, run.end);
+                    else
+                        crossing[band].emplace_back(row, &run);
+                }
+        }
+    });
+    const vector<int32_t>& roots = equivalence.parents;
+    for (int band = 0; band < n_bands; ++band)
+        for (auto& run : crossing[band])
+            label_stats[roots[run.second->label]].add_run(run.first, run.second->begin, run.second->end);
+
+    // 4. count the regions that are large enough in each band to find the first id of each band
+    vector<size_t> first_ids(n_bands + 1, 0);
+    auto band_labels = [&](int band) { return cv::Range(first_labels[band * band_rows], first_labels[min(rows, (band + 1) * band_rows)]); };
+    cv::parallel_for_(cv::Range(0, n_bands), [&](const cv::Range& range)
+    {
+        for (int band = range.start; band < range.end; ++band)
+        {
+            cv::Range labels = band_labels(band);
+            for (int32_t label = labels.start; label < labels.end; ++label)
+                if (roots[label] == label && label_stats[label].size >= treshold)
+                    ++first_ids[band+1];
+        }
+    });
+    for (int band = 0; band < n_bands; ++band)
+        first_ids[band+1] += first_ids[band];
+
+    // 5. give ids to the roots in raster order, then the other labels take the ids of their roots
+    stats.resize(first_ids[n_bands]);
+    vector<int32_t> ids(n_labels, 0);
+    cv::parallel_for_(cv::Range(0, n_bands), [&](const cv::Range& range)
+    {
+        for (int band = range.start; band < range.end; ++band)
+        {
+            cv::Range labels = band_labels(band);
+            size_t id = first_ids[band];
+            for (int32_t label = labels.start; label < labels.end; ++label)
+            {
+                if (roots[label] != label)
+                    continue;
+                if (label_stats[label].size >= treshold)
+                {
+                    stats[id] = label_stats[label];
+                    ids[label] = (int32_t)++id;
+                }
+                else
+                    ids[label] = removed_id;
+            }
+        }
+    });
+    cv::parallel_for_(cv::Range(0, n_bands), [&](const cv::Range& range)
+    {
+        for (int band = range.start; band < range.end; ++band)
+        {
+            cv::Range labels = band_labels(band);
+            for (int32_t label = labels.start; label < labels.end; ++label)
+                if (roots[label] != label)
+                    ids[label] = ids[roots[label]];
+        }
+    });
+    return ids;
 }
 
-size_t Separator::AfterTresholdGrowing::compute(
-    cv::Mat& data,
-    cv::Mat& output,
-    std::unique_ptr<Groups>&& groups,
-    std::unique_ptr<PixelMat>&& pixel_mat)
+size_t BinarySeparator::compute(cv::Mat& input_data, cv::Mat& output_data, std::unique_ptr<StatePlane>&& state_plane_init)
 {
-    auto x = Growing::compute(data,output,move(groups),move(pixel_mat));
-    // because some of the areas were removed during tresholding, we need to remap the group IDs to [1..n]
-    remap(output);
-    return x;
-}
\ No newline at end of file
+    if (input_data.type() != CV_8UC1)
+        throw logic_error("Error: BinarySeparator expects single channel 8-bit image!");
+
+    // the state plane is only prepared for the following stages as in Separator
+    if (state_plane_init == nullptr)
+        state_plane = make_unique<StatePlane>(input_data.rows, input_data.cols, State::closed);
+    else
+    {
+        state_plane = move(state_plane_init);
+        for (int row = 0; row < state_plane->rows; ++row)
+            fill_n(&(*state_plane)[state_plane->index(row, 0)], state_plane->cols, State::closed);
+    }
+
+    vector<vector<Run>> runs;
+    if (input_data.cols > 0)
+        find_runs(input_data, runs);
+
+    // 1. - 2. label the runs and give ids to the regions that are large enough, the regions smaller than treshold
+    // become background (there is nothing to fill in binary image)
+    vector<int32_t> ids = (parallel ? label_runs_parallel(runs) : label_runs(runs));
+
+    // 3. write the ids of the runs
+    cv::Mat output = cv::Mat::zeros(input_data.size(), label_depth((int64_t)stats.size()));
+    with_label_type(output.depth(), [&](auto label)
+    {
+        using label_t = decltype(label);
+        cv::parallel_for_(cv::Range(0, output.rows), [&](const cv::Range& range)
+        {
+            for (int row = range.start; row < range.end; ++row)
+            {
+                label_t* values = output.ptr<label_t>(row);
+                for (const Run& run : runs[row])
+                    fill(values + run.begin, values + run.end, (label_t)max(ids[run.label], 0));
+            }
+        });
+    });
+
+    // 4. groups of the pixels by the runs (runs are in raster order, so the pixels of each group are sorted)
+    groups = (build_groups ? make_unique<Groups>() : nullptr);
+    vector<pixel_idx_t> next(stats.size());
+    if (build_groups)
+    {
+        for (size_t i = 0; i < stats.size(); ++i)
+        {
+            groups->values.push_back((int)i + 1);
+            next[i] = groups->offsets.back();
+            groups->offsets.push_back(groups->offsets.back() + (pixel_idx_t)stats[i].size);
+        }
+        groups->pixels.resize(groups->offsets.back());
+    }
+    if (build_groups)
+        for (size_t row = 0; row < runs.size(); ++row)
+            for (const Run& run : runs[row])
+            {
+                int32_t id = ids[run.label];
+                if (id == removed_id)
+                    continue;
+                pixel_idx_t pixel = (pixel_idx_t)row * input_data.cols + run.begin;
+                for (int col = run.begin; col < run.end; ++col, ++pixel)
+                    groups->pixels[next[id-1]++] = pixel;
+            }
+
+    output_data = output;
+    return stats.size();
+}
@@ -1,9 +1,13 @@
 #include "utils.hpp"
 
 #include <map>
+#include <algorithm>
+#include <cmath>
+#include <memory>
 #include <iostream>
 
 #include <opencv2/highgui.hpp>
+#include "simd.hpp"
 
 using namespace std;
 
@@ -110,7 +114,7 @@ void smoothEdges(cv::InputArray src, cv::OutputArray dst, int ksize, int iter)
     cv::pyrDown(dst,dst);
 }
 
-// Convert the CV_16S image to CV_8U (% 256) and apply colormap to create CV_8UC3 image
+// Convert the label image (CV_16S or CV_32S) to CV_8U (% 256) and apply colormap to create CV_8UC3 image
 cv::Mat colorizeByCmap(const cv::Mat& input, cv::ColormapTypes map, bool copy, bool apply_random_LUT)
 {
     cv::Mat data;
@@ -119,9 +123,12 @@ cv::Mat colorizeByCmap(const cv::Mat& input, cv::ColormapTypes map, bool copy, b
     else
         data  = cv::Mat(input);
 
-    for (int row = 0; row < data.rows; ++row)
-        for (int col = 0; col < data.cols; ++col)
-            data.at<int16_t>(row,col) %= 256;
+    with_label_type(data.depth(), [&](auto label)
+    {
+        for (int row = 0; row < data.rows; ++row)
+            for (int col = 0; col < data.cols; ++col)
+                data.at<decltype(label)>(row,col) %= 256;
+    });
 
     data.convertTo(data, CV_8U);
     if (apply_random_LUT)
@@ -135,56 +142,579 @@ cv::Mat colorizeByCmap(const cv::Mat& input, cv::ColormapTypes map, bool copy, b
 cv::Mat colorizeByTemplate(const cv::Mat& color_template, const Groups* groups)
 {
     cv::Mat data = cv::Mat::zeros(color_template.size(), CV_8UC3);
+    // groups store linear pixel indices, so we need continuous memory to address the pixels
+    cv::Mat input = color_template.isContinuous() ? color_template : color_template.clone();
+    const cv::Vec3b* pixels = input.ptr<cv::Vec3b>();
+    cv::Vec3b* output = data.ptr<cv::Vec3b>();
 
-    for (auto&& cls : *groups)
+    for (auto cls : *groups)
     {
         uint64_t r(0),g(0),b(0);
-        for (auto&& pixel : cls.second)
+        for (auto pixel : cls)
         {
-            auto& c = color_template.at<cv::Vec3b>(pixel->row, pixel->col);
+            auto& c = pixels[pixel];
             r += c[0];
             g += c[1];
             b += c[2];
         }
-        r /= cls.second.size();
-        g /= cls.second.size();
-        b /= cls.second.size();
+        r /= cls.size();
+        g /= cls.size();
+        b /= cls.size();
         cv::Vec3b color((uchar)r,(uchar)g,(uchar)b);
 
-        for (auto&& pixel : cls.second)
-            data.at<cv::Vec3b>(pixel->row, pixel->col) = color;
+        for (auto pixel : cls)
+            output[pixel] = color;
     }
 
     return data;
 }
 
 // KMeans color clustering
-void kmeansColor(cv::Mat ocv, cv::Mat& output, int K)
+cv::Mat kmeansLabels(const cv::Mat& input, int K, cv::Mat* centers)
 {
     // convert to float & reshape to a [3 x W*H] Mat 
     //  (so every pixel is on a row of it's own)
     cv::Mat data;
-    ocv.convertTo(data, CV_32F);
+    input.convertTo(data, CV_32F);
     data = data.reshape(1, (int)data.total());
 
     // do kmeans
-    cv::Mat labels, centers;
+    cv::Mat labels, cluster_centers;
     cv::kmeans(data, K, labels, cv::TermCriteria(cv::TermCriteria::COUNT, 10, 1.0), 1, 
-        cv::KMEANS_PP_CENTERS, centers);
+        cv::KMEANS_PP_CENTERS, cluster_centers);
+    if (centers != nullptr)
+        *centers = cluster_centers;
+
+    // back to 2d, the clusters are numbered from 1 (so none of them is background)
+    labels = labels.reshape(1, input.rows);
+    labels += cv::Scalar(1);
+    return labels;
+}
+
+/*
+Weighted KMeans of the points (colors with given number of channels stored one after another) - KMeans++
+initialization with fixed seed (so the result is deterministic) and at most given number of Lloyd iterations
+(they stop earlier if no center moves more than epsilon). Returns the centers and the cluster of each point,
+K is decreased if there are less distinct points.
+*/
+static vector<double> weightedKMeans(const vector<double>& points, const vector<double>& weights, int channels,
+    int& K, int iterations, vector<int>& assignment, double epsilon = 0)
+{
+    const size_t n = weights.size();
+    K = min(K, (int)n);
+    if (K <= 0)
+        throw logic_error("Error: Number of clusters must be positive!");
+
+    auto distance = [&](size_t point, const double* center)
+    {
+        double d = 0;
+        for (int c = 0; c < channels; ++c)
+            d += (points[point * channels + c] - center[c]) * (points[point * channels + c] - center[c]);
+        return d;
+    };
+    vector<double> centers;
+    assignment.assign(n, 0);
+    auto assign = [&]()
+    {
+        for (size_t point = 0; point < n; ++point)
+        {
+            double best = numeric_limits<double>::infinity();
+            for (int k = 0; k < K; ++k)
+            {
+                double d = distance(point, &centers[k * channels]);
+                if (d < best)
+                {
+                    best = d;
+                    assignment[point] = k;
+                }
+            }
+        }
+    };
+
+    // 1. KMeans++ initialization weighted by the weights of the points
+    mt19937 gen(0);
+    vector<double> nearest(n, numeric_limits<double>::infinity());
+    vector<double> probabilities(weights);
+    for (int k = 0; k < K; ++k)
+    {
+        discrete_distribution<size_t> distr(probabilities.begin(), probabilities.end());
+        size_t chosen = distr(gen);
+        centers.insert(centers.end(), &points[chosen * channels], &points[(chosen + 1) * channels]);
+        for (size_t point = 0; point < n; ++point)
+        {
+            nearest[point] = min(nearest[point], distance(point, &centers[k * channels]));
+            probabilities[point] = weights[point] * nearest[point];
+        }
+        // all the remaining points are at some center already
+        if (k + 1 < K && std::all_of(probabilities.begin(), probabilities.end(), [](double p){ return p == 0; }))
+            K = k + 1;
+    }
+
+    // 2. weighted Lloyd iterations
+    for (int iteration = 0; iteration < iterations; ++iteration)
+    {
+        assign();
+        vector<double> sums(K * channels, 0), cluster_weights(K, 0);
+        for (size_t point = 0; point < n; ++point)
+        {
+            cluster_weights[assignment[point]] += weights[point];
+            for (int c = 0; c < channels; ++c)
+                sums[assignment[point] * channels + c] += weights[point] * points[point * channels + c];
+        }
+        double shift = 0;
+        for (int k = 0; k < K; ++k)
+        {
+            if (cluster_weights[k] == 0)
+                continue;
+            double distance = 0;
+            for (int c = 0; c < channels; ++c)
+            {
+                double center = sums[k * channels + c] / cluster_weights[k];
+                distance += (center - centers[k * channels + c]) * (center - centers[k * channels + c]);
+                centers[k * channels + c] = center;
+            }
+            shift = max(shift, distance);
+        }
+        if (shift <= epsilon * epsilon)
+            break;
+    }
+    assign();
+    return centers;
+}
+
+// Stores the centers in the same layout as the centers of cv::kmeans (one row per cluster)
+static void storeCenters(const vector<double>& cluster_centers, int K, int channels, cv::Mat* centers)
+{
+    if (centers == nullptr)
+        return;
+    *centers = cv::Mat(K, channels, CV_32F);
+    for (int k = 0; k < K; ++k)
+        for (int c = 0; c < channels; ++c)
+            centers->at<float>(k, c) = (float)cluster_centers[k * channels + c];
+}
+
+// Index of the bin of the color histogram with given bits per channel
+static inline uint32_t colorBin(const uchar* pixel, int channels, int bits)
+{
+    uint32_t bin = 0;
+    for (int c = 0; c < channels; ++c)
+        bin = (bin << bits) | (uint32_t)(pixel[c] >> (8 - bits));
+    return bin;
+}
+
+/*
+Color histogram of 8-bit image with given bits per channel - finds the non-empty bins with their number of pixels
+(weights) and the mean colors of their pixels (stored one after another). Bands of rows are counted in parallel
+to their own histograms and summed up.
+*/
+static void colorHistogram(const cv::Mat& input, int bits, vector<uint32_t>& bins, vector<double>& weights,
+    vector<double>& colors)
+{
+    if (input.depth() != CV_8U)
+        throw logic_error("Error: Histogram quantizer needs 8-bit image!");
+    if (bits < 1 || bits > 8 || bits * input.channels() > 24)
+        throw logic_error("Error: Invalid number of bits of the histogram bins!");
+    const int channels = input.channels();
+    const size_t n_bins = (size_t)1 << (bits * channels);
+    // every bin keeps the number of pixels and the sums of their channels (to find the mean color of the bin)
+    const int bin_size = channels + 1;
+
+    const int n_bands = max(1, min(input.rows, cv::getNumThreads()));
+    vector<vector<int64_t>> band_histograms(n_bands);
+    cv::parallel_for_(cv::Range(0, n_bands), [&](const cv::Range& range)
+    {
+        for (int band = range.start; band < range.end; ++band)
+        {
+            vector<int64_t>& histogram = band_histograms[band];
+            histogram.assign(n_bins * bin_size, 0);
+            for (int row = input.rows * band / n_bands; row < input.rows * (band + 1) / n_bands; ++row)
+            {
+                const uchar* pixel = input.ptr<uchar>(row);
+                for (int col = 0; col < input.cols; ++col, pixel += channels)
+                {
+                    int64_t* bin = &histogram[colorBin(pixel, channels, bits) * bin_size];
+                    ++bin[0];
+                    for (int c = 0; c < channels; ++c)
+                        bin[c+1] += pixel[c];
+                }
+            }
+        }
+    });
+    vector<int64_t>& histogram = band_histograms[0];
+    for (int band = 1; band < n_bands; ++band)
+        for (size_t i = 0; i < histogram.size(); ++i)
+            histogram[i] += band_histograms[band][i];
+
+    bins.clear();
+    weights.clear();
+    colors.clear();
+    for (size_t bin = 0; bin < n_bins; ++bin)
+    {
+        const int64_t* h = &histogram[bin * bin_size];
+        if (h[0] == 0)
+            continue;
+        bins.push_back((uint32_t)bin);
+        weights.push_back((double)h[0]);
+        for (int c = 0; c < channels; ++c)
+            colors.push_back((double)h[c+1] / h[0]);
+    }
+}
+
+// Labels the pixels by the lookup table of the bins of the color histogram (in parallel by rows)
+static cv::Mat mapColorBins(const cv::Mat& input, int bits, const vector<int32_t>& lut)
+{
+    const int channels = input.channels();
+    cv::Mat labels(input.size(), CV_32S);
+    cv::parallel_for_(cv::Range(0, input.rows), [&](const cv::Range& range)
+    {
+        for (int row = range.start; row < range.end; ++row)
+        {
+            const uchar* pixel = input.ptr<uchar>(row);
+            int32_t* label = labels.ptr<int32_t>(row);
+            for (int col = 0; col < input.cols; ++col, pixel += channels)
+                label[col] = lut[colorBin(pixel, channels, bits)];
+        }
+    });
+    return labels;
+}
 
-    // reshape both to a single row of Vec3f pixels:
-    centers = centers.reshape(3,centers.rows);
-    data = data.reshape(3,data.rows);
+// Color clustering by weighted KMeans of the bins of the color histogram
+cv::Mat histogramLabels(const cv::Mat& input, int K, cv::Mat* centers, int bits)
+{
+    // 1. histogram of the image
+    vector<uint32_t> bins;
+    vector<double> weights;
+    vector<double> colors;
+    colorHistogram(input, bits, bins, weights, colors);
+
+    // 2. KMeans of the bins weighted by their number of pixels (the same number of iterations as cv::kmeans in
+    // kmeansLabels), there are only a few thousands of bins, so it is cheap
+    vector<int> assignment;
+    vector<double> cluster_centers = weightedKMeans(colors, weights, input.channels(), K, 10, assignment);
+    storeCenters(cluster_centers, K, input.channels(), centers);
+
+    // 3. map the pixels through the lookup table of the clusters of the bins, the clusters are numbered from 1
+    vector<int32_t> lut((size_t)1 << (bits * input.channels()), 0);
+    for (size_t bin = 0; bin < bins.size(); ++bin)
+        lut[bins[bin]] = assignment[bin] + 1;
+    return mapColorBins(input, bits, lut);
+}
+
+PaletteTree::PaletteTree(const cv::Mat& input, int max_colors, int bits)
+: image(input), bits(bits), channels(input.channels()), parents(1, -1)
+{
+    if (max_colors <= 0)
+        throw logic_error("Error: Number of clusters must be positive!");
+    colorHistogram(input, bits, bins, weights, colors);
+    clusters.assign(bins.size(), 0);
+
+    // sum of squared distances of the colors of the bins of the cluster from its mean (weighted by the bins)
+    auto error = [&](const vector<size_t>& members)
+    {
+        double weight = 0;
+        vector<double> mean(channels, 0);
+        for (size_t bin : members)
+        {
+            weight += weights[bin];
+            for (int c = 0; c < channels; ++c)
+                mean[c] += weights[bin] * colors[bin * channels + c];
+        }
+        double sum = 0;
+        for (size_t bin : members)
+            for (int c = 0; c < channels; ++c)
+            {
+                double d = colors[bin * channels + c] - mean[c] / weight;
+                sum += weights[bin] * d * d;
+            }
+        return sum;
+    };
 
-    // replace pixel values with their center value:
-    cv::Vec3f *p = data.ptr<cv::Vec3f>();
-    for (int i=0; i<data.rows; i++) {
-        int center_id = labels.at<int>(i);
-        p[i] = centers.at<cv::Vec3f>(center_id);
+    // the bins of each cluster and its error (negative if it can't be split)
+    vector<vector<size_t>> members(1);
+    for (size_t bin = 0; bin < bins.size(); ++bin)
+        members[0].push_back(bin);
+    vector<double> errors(1, error(members[0]));
+
+    // the cluster with the largest error is split into two by weighted 2-means, the second part gets a new id
+    // (so the clusters of the first K splits are exactly the clusters of level K + 1)
+    while ((int)parents.size() < max_colors)
+    {
+        int cluster = (int)(std::max_element(errors.begin(), errors.end()) - errors.begin());
+        if (errors[cluster] <= 0)
+            break;
+        vector<size_t> points = members[cluster];
+        vector<double> split_colors(points.size() * channels), split_weights(points.size());
+        for (size_t i = 0; i < points.size(); ++i)
+        {
+            split_weights[i] = weights[points[i]];
+            copy(&colors[points[i] * channels], &colors[(points[i] + 1) * channels], &split_colors[i * channels]);
+        }
+        int K = 2;
+        vector<int> assignment;
+        weightedKMeans(split_colors, split_weights, channels, K, 10, assignment);
+        vector<size_t> first, second;
+        for (size_t i = 0; i < points.size(); ++i)
+            (assignment[i] == 0 ? first : second).push_back(points[i]);
+        if (first.empty() || second.empty())
+        {
+            errors[cluster] = -1;
+            continue;
+        }
+        int id = (int)parents.size();
+        parents.push_back(cluster);
+        for (size_t bin : second)
+            clusters[bin] = id;
+        errors[cluster] = error(first);
+        errors.push_back(error(second));
+        members[cluster].swap(first);
+        members.push_back(move(second));
     }
-    // back to 2d, and uchar:
-    output = data.reshape(3, ocv.rows);
-    output.convertTo(output, CV_8U);
+}
+
+cv::Mat PaletteTree::labels(int n_colors, cv::Mat* centers) const
+{
+    n_colors = max(1, min(n_colors, levels()));
+    // the clusters of the bins at the level - the clusters created by later splits are merged to their parents
+    vector<int> level_clusters(clusters);
+    for (int& cluster : level_clusters)
+        while (cluster >= n_colors)
+            cluster = parents[cluster];
+
+    if (centers != nullptr)
+    {
+        vector<double> sums(n_colors * channels, 0), cluster_weights(n_colors, 0);
+        for (size_t bin = 0; bin < bins.size(); ++bin)
+        {
+            cluster_weights[level_clusters[bin]] += weights[bin];
+            for (int c = 0; c < channels; ++c)
+                sums[level_clusters[bin] * channels + c] += weights[bin] * colors[bin * channels + c];
+        }
+        for (int k = 0; k < n_colors; ++k)
+            if (cluster_weights[k] > 0)
+                for (int c = 0; c < channels; ++c)
+                    sums[k * channels + c] /= cluster_weights[k];
+        storeCenters(sums, n_colors, channels, centers);
+    }
+
+    vector<int32_t> lut((size_t)1 << (bits * channels), 0);
+    for (size_t bin = 0; bin < bins.size(); ++bin)
+        lut[bins[bin]] = level_clusters[bin] + 1;
+    return mapColorBins(image, bits, lut);
+}
+
+/*
+Row kernels of the nearest center assignment - label every of 'size' pixels (with 'channels' 8-bit channels)
+by the number (from 1) of the nearest of the K centers (rounded to integers), the first one wins the ties.
+All kernels give the same results.
+*/
+typedef void (*nearest_row_funct_t)(const uchar* pixels, int channels, const int32_t* centers, int K, int32_t* labels, int size);
+
+static void nearest_row_scalar(const uchar* pixels, int channels, const int32_t* centers, int K, int32_t* labels, int size)
+{
+    for (int i = 0; i < size; ++i, pixels += channels)
+    {
+        int32_t best = numeric_limits<int32_t>::max();
+        for (int k = 0; k < K; ++k)
+        {
+            int32_t d = 0;
+            for (int c = 0; c < channels; ++c)
+                d += (pixels[c] - centers[k * channels + c]) * (pixels[c] - centers[k * channels + c]);
+            if (d < best)
+            {
+                best = d;
+                labels[i] = k + 1;
+            }
+        }
+    }
+}
+
+#ifdef VORONIZER_AVX2
+VORONIZER_TARGET("avx2")
+static void nearest_row_avx2(const uchar* pixels, int channels, const int32_t* centers, int K, int32_t* labels, int size)
+{
+    // the channels of 8 pixels are gathered by 32-bit loads from the interleaved row, so the last load of the block
+    // reads 3 bytes after the last channel - the blocks stop before the end of the row
+    const __m256i offsets = _mm256_mullo_epi32(_mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7), _mm256_set1_epi32(channels));
+    const __m256i byte_mask = _mm256_set1_epi32(0xFF);
+    int i = 0;
+    for (; (i + 8) * channels + 3 <= size * channels; i += 8)
+    {
+        __m256i values[4];
+        for (int c = 0; c < channels; ++c)
+        {
+            const int* base = (const int*)(pixels + (size_t)i * channels + c);
+            values[c] = _mm256_and_si256(_mm256_i32gather_epi32(base, offsets, 1), byte_mask);
+        }
+        __m256i best = _mm256_set1_epi32(numeric_limits<int32_t>::max());
+        __m256i label = _mm256_setzero_si256();
+        for (int k = 0; k < K; ++k)
+        {
+            __m256i d = _mm256_setzero_si256();
+            for (int c = 0; c < channels; ++c)
+            {
+                __m256i diff = _mm256_sub_epi32(values[c], _mm256_set1_epi32(centers[k * channels + c]));
+                d = _mm256_add_epi32(d, _mm256_mullo_epi32(diff, diff));
+            }
+            __m256i closer = _mm256_cmpgt_epi32(best, d);
+            best = _mm256_min_epi32(best, d);
+            label = _mm256_blendv_epi8(label, _mm256_set1_epi32(k + 1), closer);
+        }
+        _mm256_storeu_si256((__m256i*)(labels + i), label);
+    }
+    nearest_row_scalar(pixels + (size_t)i * channels, channels, centers, K, labels + i, size - i);
+}
+#endif
+
+// Select the widest kernel supported by the CPU
+static nearest_row_funct_t select_nearest_row_funct()
+{
+#ifdef VORONIZER_AVX2
+    if (cv::checkHardwareSupport(CV_CPU_AVX2))
+        return nearest_row_avx2;
+#endif
+    return nearest_row_scalar;
+}
+
+/*
+Assigns all the pixels of 8-bit image to the nearest of the K centers (in parallel by bands of rows, each band sums up
+the colors of its clusters), then moves the centers to the means of their clusters (as the centers of cv::kmeans)
+and returns the largest drift of a center. If sums is false, only the labels are assigned and the result is zero.
+*/
+static double assignNearest(const cv::Mat& input, vector<double>& cluster_centers, int K, cv::Mat& labels, bool sums)
+{
+    static const nearest_row_funct_t nearest_row = select_nearest_row_funct();
+    const int channels = input.channels();
+    vector<int32_t> rounded(cluster_centers.size());
+    for (size_t i = 0; i < cluster_centers.size(); ++i)
+        rounded[i] = (int32_t)lround(cluster_centers[i]);
+
+    labels.create(input.size(), CV_32S);
+    const int n_bands = max(1, min(input.rows, cv::getNumThreads()));
+    vector<vector<int64_t>> band_sums(n_bands, vector<int64_t>(sums ? K * (channels + 1) : 0, 0));
+    cv::parallel_for_(cv::Range(0, n_bands), [&](const cv::Range& range)
+    {
+        for (int band = range.start; band < range.end; ++band)
+        {
+            int64_t* band_sum = band_sums[band].data();
+            for (int row = input.rows * band / n_bands; row < input.rows * (band + 1) / n_bands; ++row)
+            {
+                const uchar* pixel = input.ptr<uchar>(row);
+                int32_t* label = labels.ptr<int32_t>(row);
+                nearest_row(pixel, channels, rounded.data(), K, label, input.cols);
+                if (!sums)
+                    continue;
+                for (int col = 0; col < input.cols; ++col, pixel += channels)
+                {
+                    int64_t* sum = band_sum + (label[col] - 1) * (channels + 1);
+                    ++sum[0];
+                    for (int c = 0; c < channels; ++c)
+                        sum[c+1] += pixel[c];
+                }
+            }
+        }
+    });
+    if (!sums)
+        return 0;
+
+    double drift = 0;
+    vector<double> mean(channels);
+    for (int k = 0; k < K; ++k)
+    {
+        int64_t count = 0;
+        for (int band = 0; band < n_bands; ++band)
+            count += band_sums[band][k * (channels + 1)];
+        if (count == 0)
+            continue;
+        double distance = 0;
+        for (int c = 0; c < channels; ++c)
+        {
+            int64_t sum = 0;
+            for (int band = 0; band < n_bands; ++band)
+                sum += band_sums[band][k * (channels + 1) + c + 1];
+            mean[c] = (double)sum / count;
+            distance += (mean[c] - cluster_centers[k * channels + c]) * (mean[c] - cluster_centers[k * channels + c]);
+        }
+        drift = max(drift, sqrt(distance));
+        copy(mean.begin(), mean.end(), cluster_centers.begin() + k * channels);
+    }
+    return drift;
+}
+
+// Color clustering by KMeans of subsample of the pixels
+cv::Mat subsampleLabels(const cv::Mat& input, int K, cv::Mat* centers, double sample, double max_drift)
+{
+    if (input.depth() != CV_8U || input.channels() > 4)
+        throw logic_error("Error: Subsample quantizer needs 8-bit image with at most 4 channels!");
+    if (sample <= 0)
+        throw logic_error("Error: Size of the subsample must be positive!");
+    const int channels = input.channels();
+    const size_t total = input.total();
+
+    // 1. strided subsample of the pixels (evenly covers the whole image and doesn't depend on random numbers)
+    size_t n_samples = (size_t)(sample <= 1 ? sample * total : sample);
+    n_samples = min(max(n_samples, (size_t)1), total);
+    const double stride = (double)total / n_samples;
+    vector<double> points(n_samples * channels);
+    for (size_t i = 0; i < n_samples; ++i)
+    {
+        size_t pixel = (size_t)(i * stride);
+        const uchar* color = input.ptr<uchar>((int)(pixel / input.cols)) + (pixel % input.cols) * channels;
+        for (int c = 0; c < channels; ++c)
+            points[i * channels + c] = color[c];
+    }
+
+    // 2. KMeans of the subsample - the subsample is small, so it is iterated until the centers converge (otherwise
+    // the centers would drift on all the pixels because of the missing iterations rather than because of the sampling)
+    vector<int> assignment;
+    vector<double> cluster_centers = weightedKMeans(points, vector<double>(n_samples, 1.0), channels, K, 100, assignment, 0.01);
+
+    // 3. assign all the pixels to the nearest centers - if the means of the clusters drift from the centers more than
+    // max_drift, the pixels are assigned again to the means (Lloyd iterations over the whole image), negative
+    // max_drift skips the check, so the pixels are assigned just once
+    constexpr int max_iterations = 10;
+    cv::Mat labels;
+    for (int iteration = 0; iteration < max_iterations; ++iteration)
+    {
+        double drift = assignNearest(input, cluster_centers, K, labels, max_drift >= 0);
+        if (max_drift < 0 || drift <= max_drift)
+            break;
+    }
+    storeCenters(cluster_centers, K, channels, centers);
+    return labels;
+}
+
+bool warmStartLabels(const cv::Mat& input, cv::Mat& centers, cv::Mat& labels, double stable_drift, double reset_drift)
+{
+    const int channels = input.channels();
+    if (input.depth() != CV_8U || channels > 4 || centers.empty() || centers.type() != CV_32F || centers.cols != channels)
+        return false;
+    const int K = centers.rows;
+    vector<double> cluster_centers(K * channels);
+    for (int k = 0; k < K; ++k)
+        for (int c = 0; c < channels; ++c)
+            cluster_centers[k * channels + c] = centers.at<float>(k, c);
+
+    // the first assignment tells how much the palette changed - if the centers drift too much, the previous centers
+    // would need many iterations (and they would likely end in a worse local minimum than new initialization)
+    double drift = assignNearest(input, cluster_centers, K, labels, true);
+    if (drift > reset_drift)
+        return false;
+    // the palette is not stable yet, one more Lloyd iteration from the moved centers
+    if (stable_drift >= 0 && drift > stable_drift)
+        assignNearest(input, cluster_centers, K, labels, true);
+    storeCenters(cluster_centers, K, channels, &centers);
+    return true;
+}
+
+cv::Mat quantizeLabels(const cv::Mat& input, int K, ColorQuantizer quantizer, cv::Mat* centers, double sample, double max_drift)
+{
+    if (quantizer == ColorQuantizer::histogram)
+        return histogramLabels(input, K, centers);
+    if (quantizer == ColorQuantizer::hierarchical)
+        return PaletteTree(input, K).labels(K, centers);
+    if (quantizer == ColorQuantizer::subsample)
+        return subsampleLabels(input, K, centers, sample, max_drift);
+    return kmeansLabels(input, K, centers);
 }
 
 /*
@@ -198,23 +728,23 @@ cv::Mat linesFromClosestPointsRandom(std::vector<cv::Point2f>& pts, cv::Size ima
 
     random_device rd;  // obtain a random number from hardware
     mt19937 gen(rd()); // seed the generator
-    auto rng = std::default_random_engine { rd() };
 
-    int16_t n = 1;
-    cv::Mat data = cv::Mat::zeros(image_size, CV_16S);
+    int n = 1;
+    cv::Mat data = cv::Mat::zeros(image_size, label_depth((int64_t)pts.size() / 2));
     while (pts.size() > pts_left_out)
     {
-        uniform_int_distribution<> distr(0, (int)(pts.size()-2)); // define the range
-
-        shuffle(pts.begin(), pts.end(), rng);
+        // the random point is moved to the end and the candidates to the beginning by partial Fisher-Yates shuffle
+        // (the same as shuffling all the points, but only the selected points are moved)
+        std::swap(pts[uniform_int_distribution<size_t>(0, pts.size()-1)(gen)], pts[pts.size()-1]);
         cv::Point2f* a = &pts[pts.size()-1];
         cv::Point2f* b = nullptr;
         size_t b_index = -1;
         double dist = numeric_limits<double>::infinity();
 
         size_t N = min(iter, pts.size()-1);
-        for (int i = 0; i < N; ++i)
+        for (size_t i = 0; i < N; ++i)
         { 
+            std::swap(pts[i], pts[uniform_int_distribution<size_t>(i, pts.size()-2)(gen)]);
             double d = cv::norm(*a-pts[i]);
             if (d < dist)
             {
@@ -234,6 +764,145 @@ cv::Mat linesFromClosestPointsRandom(std::vector<cv::Point2f>& pts, cv::Size ima
     return data;
 }
 
+/*
+Uniform grid of the points for the nearest neighbor search of linesFromClosestPoints. The used points are removed
+lazily - they stay in their cells until a search visits the cell.
+*/
+class PointGrid
+{
+public:
+    PointGrid(const vector<cv::Point2f>& pts, const vector<char>& used, size_t n_unused)
+    : pts(pts), used(used)
+    {
+        min_x = min_y = numeric_limits<float>::max();
+        float max_x = numeric_limits<float>::lowest(), max_y = numeric_limits<float>::lowest();
+        for (size_t i = 0; i < pts.size(); ++i)
+            if (!used[i])
+            {
+                min_x = min(min_x, pts[i].x); max_x = max(max_x, pts[i].x);
+                min_y = min(min_y, pts[i].y); max_y = max(max_y, pts[i].y);
+            }
+        if (n_unused == 0)
+            min_x = max_x = min_y = max_y = 0;
+        // about two points per cell
+        double area = max(1.0, (double)(max_x - min_x) * (max_y - min_y));
+        cell_size = (float)max(1.0, sqrt(2 * area / max(n_unused, (size_t)1)));
+        cols = (int)((max_x - min_x) / cell_size) + 1;
+        rows = (int)((max_y - min_y) / cell_size) + 1;
+        cells.assign((size_t)cols * rows, {});
+        for (size_t i = 0; i < pts.size(); ++i)
+            if (!used[i])
+                cells[cell(pts[i].y, rows, min_y) * cols + cell(pts[i].x, cols, min_x)].push_back((uint32_t)i);
+    }
+
+    // Finds the closest unused point to the point (other than itself), returns -1 if there is none
+    int64_t nearest(size_t point)
+    {
+        const cv::Point2f& p = pts[point];
+        int col = cell(p.x, cols, min_x);
+        int row = cell(p.y, rows, min_y);
+        int64_t best = -1;
+        double best_dist = numeric_limits<double>::infinity();
+        // the cells are searched by rings around the cell of the point, the points beyond the ring r are at least
+        // r cells far, so the search stops when the closest point found is closer
+        for (int r = 0; r <= max(cols, rows); ++r)
+        {
+            for (int y = max(row - r, 0); y <= min(row + r, rows - 1); ++y)
+            {
+                // the inner rows of the ring have only the first and the last cell
+                int step = (y == row - r || y == row + r) ? 1 : 2 * r;
+                for (int x = col - r; x <= col + r; x += max(step, 1))
+                {
+                    if (x < 0 || x >= cols)
+                        continue;
+                    vector<uint32_t>& members = cells[(size_t)y * cols + x];
+                    for (size_t i = 0; i < members.size();)
+                    {
+                        uint32_t other = members[i];
+                        if (used[other])
+                        {
+                            members[i] = members.back();
+                            members.pop_back();
+                            continue;
+                        }
+                        ++i;
+                        if (other == point)
+                            continue;
+                        double dx = pts[other].x - p.x, dy = pts[other].y - p.y;
+                        double dist = dx * dx + dy * dy;
+                        // ties are resolved by the index, so the result doesn't depend on the order in the cells
+                        if (dist < best_dist || (dist == best_dist && other < best))
+                        {
+                            best_dist = dist;
+                            best = other;
+                        }
+                    }
+                }
+            }
+            if (best >= 0 && best_dist <= (double)r * cell_size * r * cell_size)
+                break;
+        }
+        return best;
+    }
+
+private:
+    const vector<cv::Point2f>& pts;
+    const vector<char>& used;
+    float min_x, min_y, cell_size;
+    int cols, rows;
+    vector<vector<uint32_t>> cells;
+
+    int cell(float value, int size, float min_value) const
+    {
+        return std::clamp((int)((value - min_value) / cell_size), 0, size - 1);
+    }
+};
+
+/*
+For each point in "pts" (in random order given by the seed), draw a line to the closest unused point. The closest
+points are found in a grid of the points (the used points are removed from it lazily and the grid is rebuilt for
+the remaining points whenever half of them is used), so it takes about O(n) instead of O(n^2) and the result is
+deterministic. The points to leave out are the same as in linesFromClosestPointsRandom.
+*/
+cv::Mat linesFromClosestPoints(const std::vector<cv::Point2f>& pts, cv::Size image_size, unsigned seed, size_t pts_left_out)
+{
+    if (pts.size()%2 != pts_left_out%2 && pts_left_out < 2)
+        ++pts_left_out;
+
+    vector<size_t> order(pts.size());
+    for (size_t i = 0; i < order.size(); ++i)
+        order[i] = i;
+    mt19937 gen(seed);
+    shuffle(order.begin(), order.end(), gen);
+
+    int n = 1;
+    cv::Mat data = cv::Mat::zeros(image_size, label_depth((int64_t)pts.size() / 2));
+    vector<char> used(pts.size(), false);
+    size_t n_unused = pts.size();
+    size_t grid_size = n_unused;
+    unique_ptr<PointGrid> grid = make_unique<PointGrid>(pts, used, n_unused);
+    for (size_t a : order)
+    {
+        if (n_unused <= pts_left_out)
+            break;
+        if (used[a])
+            continue;
+        // the grid of the remaining points keeps the cells dense, so the searches stay short
+        if (2 * n_unused < grid_size)
+        {
+            grid = make_unique<PointGrid>(pts, used, n_unused);
+            grid_size = n_unused;
+        }
+        int64_t b = grid->nearest(a);
+        if (b < 0)
+            throw logic_error("Error: there are no points left!");
+        cv::line(data, pts[a], pts[b], n++, 2);
+        used[a] = used[b] = true;
+        n_unused -= 2;
+    }
+    return data;
+}
+
 void fitImage(const cv::Mat& src, cv::Mat& dst, uint size)
 {
     cv::Size s = src.size();
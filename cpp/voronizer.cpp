@@ -1,8 +1,11 @@
 #include "voronizer.hpp"
 
 #include <limits>
+#include <algorithm>
 #include <random>
 #include <iostream>
+#include <cmath>
+#include <unordered_map>
 
 #include "utils.hpp"
 #include "separator.hpp"
@@ -11,10 +14,80 @@
 using namespace std;
 
 AbstractVoronizer::AbstractVoronizer()
+: engine(VoronoiEngine::growing), report(false), parallel(false), tile_size(0), seed(0)
 {
     unset_colormap();
 }
 
+void AbstractVoronizer::set_engine(VoronoiEngine engine, bool report)
+{
+    this->engine = engine;
+    this->report = report;
+}
+
+void AbstractVoronizer::set_parallel(bool parallel)
+{
+    this->parallel = parallel;
+}
+
+void AbstractVoronizer::set_seed(unsigned seed)
+{
+    this->seed = seed;
+}
+
+void AbstractVoronizer::set_tile_size(int tile_size)
+{
+    this->tile_size = tile_size;
+}
+
+std::unique_ptr<Groups> AbstractVoronizer::computeVoronoi(cv::Mat& generators, cv::Mat& output, std::unique_ptr<StatePlane>&& state_plane)
+{
+    if (engine == VoronoiEngine::growing)
+    {
+        Voronoi voronoi;
+        voronoi.set_parallel(parallel);
+        voronoi.set_tile_size(tile_size);
+        voronoi.compute(generators, output, move(state_plane));
+        return voronoi.clear_groups();
+    }
+
+    // generators and output can be the same image, keep the generators for the reference growing
+    cv::Mat reference_generators;
+    if (report)
+        reference_generators = generators.clone();
+
+    unique_ptr<Groups> groups;
+    auto time = measureTime<chrono::microseconds>([&]()
+    {
+        if (engine == VoronoiEngine::edt)
+        {
+            EDTVoronoi voronoi;
+            voronoi.compute(generators, output);
+            groups = voronoi.clear_groups();
+        }
+        else
+        {
+            JFAVoronoi voronoi(engine == VoronoiEngine::jfa_extra_pass);
+            voronoi.compute(generators, output);
+            groups = voronoi.clear_groups();
+        }
+    });
+
+    if (report)
+    {
+        cv::Mat reference;
+        Voronoi voronoi;
+        voronoi.set_parallel(parallel);
+        voronoi.set_tile_size(tile_size);
+        auto reference_time = measureTime<chrono::microseconds>([&]()
+            { voronoi.compute(reference_generators, reference, move(state_plane)); });
+
+        cerr << "Voronoi engine: " << time / 1000.0 << " ms, growing: " << reference_time / 1000.0 << " ms, "
+             << compareVoronoi(output, reference) << endl;
+    }
+    return groups;
+}
+
 void AbstractVoronizer::unset_colormap()
 {
     colorize_funct = [&](const cv::Mat& input, const cv::Mat& voronoi_output, const Groups* voronoi_groups)
@@ -104,14 +177,15 @@ cv::Mat SobelVoronizer::run(cv::Mat& input)
     if (median_post > 0)
         cv::medianBlur(data, data, (int)median_post);
 
-    Separator separator(cluster_size_treshold, 0);
-    data.convertTo(data, CV_16S);
+    // the edges are binary, so they are labeled directly by runs of the 8-bit image
+    BinarySeparator separator(cluster_size_treshold);
+    separator.set_build_groups(false);
+    separator.set_parallel(parallel);
     separator.compute(data, data);
     
-    Voronoi voronoi;
-    voronoi.compute(data, data, separator.clear_groups(), separator.clear_pixelmat());
+    auto groups = computeVoronoi(data, data, separator.clear_state_plane());
 
-    return colorize_funct(input, data, &*voronoi.groups);
+    return colorize_funct(input, data, &*groups);
 }
 
 
@@ -122,7 +196,36 @@ AbstractKMeansVoronizer::AbstractKMeansVoronizer(size_t median_pre, size_t n_col
     this->median_pre = median_pre;
     this->n_colors = n_colors;
     this->cluster_size_treshold = cluster_size_treshold;
+    this->quantizer = ColorQuantizer::kmeans;
+    this->sample = default_subsample;
+    this->max_drift = default_max_drift;
+    this->warm_start = false;
+    this->reset_drift = default_reset_drift;
+    this->stable_drift = default_stable_drift;
+    this->streaming = false;
+}
+
+void AbstractKMeansVoronizer::set_quantizer(ColorQuantizer quantizer, double sample, double max_drift)
+{
+    this->quantizer = quantizer;
+    this->sample = sample;
+    this->max_drift = max_drift;
+}
+
+void AbstractKMeansVoronizer::set_warm_start(bool warm_start, double reset_drift, double stable_drift)
+{
+    this->warm_start = warm_start;
+    this->reset_drift = reset_drift;
+    this->stable_drift = stable_drift;
+    if (!warm_start)
+        palette.release();
 }
+
+void AbstractKMeansVoronizer::set_streaming(bool streaming)
+{
+    this->streaming = streaming;
+}
+
 KMeansVoronizerCircles::KMeansVoronizerCircles(size_t median_pre, size_t n_colors, size_t cluster_size_treshold, size_t radius, int thickness)
 : AbstractKMeansVoronizer(median_pre, n_colors, cluster_size_treshold)
 {
@@ -192,30 +295,76 @@ std::unique_ptr<KMeansVoronizerLines> KMeansVoronizerLines::create(const std::st
         cerr << "Warning: MEDIAN_PRE must be either zero or an odd number. Changing from "
              << median_pre << " to " << ++median_pre << "." << endl;
 
-    if (n_colors == 0 || n_iter == 0)
+    if (n_colors == 0)
         return nullptr;
     
     return make_unique<KMeansVoronizerLines>(median_pre, n_colors, cluster_size_treshold, n_iter);
 
 }
 
-cv::Mat AbstractKMeansVoronizer::run(cv::Mat& input)
+cv::Mat AbstractKMeansVoronizer::preprocess(const cv::Mat& input)
 {
     cv::Mat data;
     if (median_pre > 0)
         cv::medianBlur(input, data, (int)median_pre); // apply median filter to speed-up the process and remove small regions
     else
         input.copyTo(data);
-    kmeansColor(data, data, (int)n_colors);
-    cv::cvtColor(data, data, cv::COLOR_RGB2GRAY);
-    Separator separator(cluster_size_treshold, -1);
-    data.convertTo(data, CV_16S);
-    separator.compute(data, data);
-    
-    auto groups = separator.clear_groups();
-    groups->erase(0);
-    
-    cv::Mat im = drawGenerators(&*groups, input.size());
+    return data;
+}
+
+cv::Mat AbstractKMeansVoronizer::run(cv::Mat& input)
+{
+    cv::Mat data = preprocess(input);
+    // with the warm start the colors are quantized from the palette of the previous image if it has all the colors
+    // and still fits, the clusters are separated into regions directly by their ids
+    cv::Mat clusters;
+    if (!warm_start || palette.rows != (int)n_colors || !warmStartLabels(data, palette, clusters, stable_drift, reset_drift))
+        clusters = quantizeLabels(data, (int)n_colors, quantizer, warm_start ? &palette : nullptr, sample, max_drift);
+    return runClusters(input, clusters);
+}
+
+std::vector<cv::Mat> AbstractKMeansVoronizer::runSweep(cv::Mat& input, const std::vector<size_t>& n_colors_levels)
+{
+    // the tree is built once for the largest number of colors, each level is then just a pass over the pixels
+    cv::Mat data = preprocess(input);
+    size_t max_colors = n_colors_levels.empty() ? 1 : *std::max_element(n_colors_levels.begin(), n_colors_levels.end());
+    PaletteTree tree(data, (int)max_colors);
+    std::vector<cv::Mat> results;
+    for (size_t level : n_colors_levels)
+    {
+        cv::Mat clusters = tree.labels((int)level);
+        results.push_back(runClusters(input, clusters));
+    }
+    return results;
+}
+
+cv::Mat AbstractKMeansVoronizer::runClusters(cv::Mat& input, cv::Mat& clusters)
+{
+    if (streaming)
+    {
+        // the regions are given in the order in which they are finished, only their stats are kept
+        std::vector<RegionStats> regions;
+        StreamingSeparator separator(clusters.cols, [&](const StreamingSeparator::Component& component)
+        {
+            regions.push_back(component.stats);
+        }, cluster_size_treshold, 0);
+        for (int row = 0; row < clusters.rows; row += stream_band_rows)
+            separator.push(clusters.rowRange(row, std::min(clusters.rows, row + stream_band_rows)));
+        separator.finish();
+
+        cv::Mat im = drawGenerators(regions, input.size());
+        auto groups = computeVoronoi(im, im);
+        return colorize_funct(input, im, &*groups);
+    }
+
+    cv::Mat data;
+    // the centers of the regions are given by their stats accumulated during the labeling, the groups are not needed
+    Separator separator(cluster_size_treshold, 0);
+    separator.set_parallel(parallel);
+    separator.set_build_groups(false);
+    separator.compute(clusters, data);
+
+    cv::Mat im = drawGenerators(separator.stats, input.size());
 
     //Show generators
     /*cv::Mat m(im);
@@ -226,64 +375,169 @@ cv::Mat AbstractKMeansVoronizer::run(cv::Mat& input)
     imshow(m, "m");
     */
 
-    Voronoi voronoi;
-    voronoi.compute(im, im, nullptr, separator.clear_pixelmat());
-
-    groups = voronoi.clear_groups();
+    auto groups = computeVoronoi(im, im, separator.clear_state_plane());
     return colorize_funct(input, im, &*groups);
 }
 
-cv::Mat KMeansVoronizerCircles::drawGenerators(const Groups* groups, cv::Size image_size)
+cv::Mat KMeansVoronizerCircles::drawGenerators(const std::vector<RegionStats>& regions, cv::Size image_size)
 {
-    cv::Mat im = cv::Mat::zeros(image_size, CV_16S);
-    for (auto& group : *groups)
+    cv::Mat im = cv::Mat::zeros(image_size, label_depth((int64_t)regions.size()));
+    for (size_t i = 0; i < regions.size(); ++i)
     {
-        size_t row = 0;
-        size_t col = 0;
-        for (auto& pixel : group.second)
-        {
-            row += pixel->row;
-            col += pixel->col;
-        }
-        row /= group.second.size();
-        col /= group.second.size();
-        cv::circle(im, cv::Point2d((float)col,(float)row), (int)(radius), group.first, thickness);
+        const RegionStats& region = regions[i];
+        int64_t row = region.sum_row / (int64_t)region.size;
+        int64_t col = region.sum_col / (int64_t)region.size;
+        cv::circle(im, cv::Point2d((float)col,(float)row), (int)(radius), (int)i + 1, thickness);
     }
     return im;
 }
 
 
-cv::Mat KMeansVoronizerLines::drawGenerators(const Groups* groups, cv::Size image_size)
+cv::Mat KMeansVoronizerLines::drawGenerators(const std::vector<RegionStats>& regions, cv::Size image_size)
 {
     std::vector<cv::Point2f> points;
-    points.reserve(groups->size());
-    for (auto& group : *groups)
+    points.reserve(regions.size());
+    for (const RegionStats& region : regions)
     {
-        int row = 0;
-        int col = 0;
-        for (auto& pixel : group.second)
-        {
-            row += pixel->row;
-            col += pixel->col;
-        }
-        row = (int)(row/group.second.size());
-        col = (int)(col/group.second.size());
+        int64_t row = region.sum_row / (int64_t)region.size;
+        int64_t col = region.sum_col / (int64_t)region.size;
         points.push_back(cv::Point2f((float)col,(float)row));
     }
 
+    if (n_iter == 0)
+        return linesFromClosestPoints(points, image_size, seed);
     return linesFromClosestPointsRandom(points, image_size, n_iter);
 }
 
 /* --- sift --- */
-cv::Mat AbstractSIFTVoronizer::run(cv::Mat& input)
+std::vector<cv::KeyPoint> AbstractSIFTVoronizer::detectKeypoints(const cv::Mat& input) const
 {
-    auto detector = cv::SIFT::create(0, 3, 0.03, 10, 1.6);
     std::vector<cv::KeyPoint> keypoints;
-    detector->detect(input, keypoints);
+    // SIFT finds a keypoint of size s in the octave o with 3.2 * 2^o <= s (the octaves have the same layers as in the
+    // whole image), it needs the Gaussian of the keypoint (3 sigma = 1.5 * s) and the border of 5 pixels of the octave
+    // around it - the tiles are extended by this overlap for the largest keypoint detected in them, so the keypoints
+    // up to max_size see the same neighborhood as in the whole image (it is enough for the patches of ORB as well),
+    // the tiles smaller than the overlap would spend most of the time in the overlap
+    const int max_size = std::max(detection_max_size, (int)corner_keypoint_size);
+    const int max_octave = std::max(0, (int)std::ceil(std::log2(max_size / 3.2)));
+    const int overlap = (int)std::ceil(1.5 * max_size) + (5 << max_octave);
+    const int tile_size = std::max(detection_tile_size, overlap);
+    const bool filter_size = hasScale();
+    if (detection_tile_size <= 0 || (input.cols <= tile_size && input.rows <= tile_size))
+    {
+        createDetector()->detect(input, keypoints);
+        return keypoints;
+    }
 
-    keypoints.erase(std::remove_if(keypoints.begin(), keypoints.end(),
-        [&](cv::KeyPoint x){return x.size < keypoint_size_treshold;}),
-    keypoints.end());
+    // 1. each tile detects the keypoints in its area extended by the overlap and keeps the keypoints with the center
+    // in its own area, the tiles are processed in parallel, each by its own detector (the detectors aren't thread-safe)
+    // with the share of the limit of the number of keypoints given by the area of the tile
+    const int tile_cols = (input.cols + tile_size - 1) / tile_size;
+    const int tile_rows = (input.rows + tile_size - 1) / tile_size;
+    const cv::Rect image_rect(0, 0, input.cols, input.rows);
+    std::vector<std::vector<cv::KeyPoint>> tile_keypoints(tile_cols * tile_rows);
+    cv::parallel_for_(cv::Range(0, tile_cols * tile_rows), [&](const cv::Range& range)
+    {
+        for (int tile = range.start; tile < range.end; ++tile)
+        {
+            cv::Rect area(tile % tile_cols * tile_size, tile / tile_cols * tile_size, tile_size, tile_size);
+            area &= image_rect;
+            cv::Rect extended(area.x - overlap, area.y - overlap, area.width + 2 * overlap, area.height + 2 * overlap);
+            extended &= image_rect;
+
+            std::vector<cv::KeyPoint> detected;
+            createDetector(area.area() / (double)image_rect.area())->detect(input(extended), detected);
+            for (cv::KeyPoint& keypoint : detected)
+            {
+                keypoint.pt.x += extended.x;
+                keypoint.pt.y += extended.y;
+                if (area.contains(cv::Point((int)keypoint.pt.x, (int)keypoint.pt.y)) && (!filter_size || keypoint.size <= max_size))
+                    tile_keypoints[tile].push_back(keypoint);
+            }
+        }
+    });
+
+    // 2. thanks to the overlap both tiles of a seam see the same neighborhood of a keypoint near it, so they find it
+    // at the same position up to the rounding - only a keypoint whose center is moved by a fraction of a pixel to the
+    // other side of the seam is kept by both of them; the keypoints closer to an inner seam (the borders of the image
+    // aren't seams) than seam_distance are hashed by their position and the keypoint with almost the same position
+    // and size from other tile is dropped (the first one in the order of the tiles is kept)
+    constexpr float seam_distance = 1.0f;
+    std::unordered_map<int64_t, std::vector<std::pair<size_t, int>>> near_seams;
+    auto cell_key = [&](int x, int y) { return (int64_t)y * (input.cols + 2) + x; };
+    auto seam_offset = [&](float position, int tiles)
+    {
+        int seam = (int)std::lround(position / tile_size);
+        if (seam < 1 || seam >= tiles)
+            return std::numeric_limits<float>::infinity();
+        return std::abs(position - (float)seam * tile_size);
+    };
+    for (int tile = 0; tile < (int)tile_keypoints.size(); ++tile)
+        for (const cv::KeyPoint& keypoint : tile_keypoints[tile])
+        {
+            const bool near_seam = seam_offset(keypoint.pt.x, tile_cols) < seam_distance
+                || seam_offset(keypoint.pt.y, tile_rows) < seam_distance;
+            if (!near_seam)
+            {
+                keypoints.push_back(keypoint);
+                continue;
+            }
+            int cell_x = (int)std::floor(keypoint.pt.x / seam_distance);
+            int cell_y = (int)std::floor(keypoint.pt.y / seam_distance);
+            bool duplicate = false;
+            for (int y = cell_y - 1; y <= cell_y + 1 && !duplicate; ++y)
+                for (int x = cell_x - 1; x <= cell_x + 1 && !duplicate; ++x)
+                {
+                    auto cell = near_seams.find(cell_key(x, y));
+                    if (cell == near_seams.end())
+                        continue;
+                    for (const auto& [other, other_tile] : cell->second)
+                    {
+                        const cv::KeyPoint& kept = keypoints[other];
+                        if (other_tile != tile
+                            && cv::norm(kept.pt - keypoint.pt) < seam_distance
+                            && std::abs(kept.size - keypoint.size) < 0.25f * std::max(kept.size, keypoint.size))
+                        {
+                            duplicate = true;
+                            break;
+                        }
+                    }
+                }
+            if (duplicate)
+                continue;
+            near_seams[cell_key(cell_x, cell_y)].emplace_back(keypoints.size(), tile);
+            keypoints.push_back(keypoint);
+        }
+
+    // 3. the keypoints larger than max_size are found in the image downscaled so that max_size becomes about 8 pixels
+    // (the octaves of the downscaled image are roughly the higher octaves of the whole image)
+    if (filter_size)
+    {
+        const double scale = std::max(2, 1 << std::max(0, (int)std::floor(std::log2(max_size / 8.0))));
+        cv::Mat downscaled;
+        cv::resize(input, downscaled, cv::Size(), 1 / scale, 1 / scale, cv::INTER_AREA);
+        std::vector<cv::KeyPoint> detected;
+        createDetector()->detect(downscaled, detected);
+        for (cv::KeyPoint& keypoint : detected)
+        {
+            keypoint.pt = (keypoint.pt + cv::Point2f(0.5f, 0.5f)) * scale - cv::Point2f(0.5f, 0.5f);
+            keypoint.size *= (float)scale;
+            if (keypoint.size > max_size)
+                keypoints.push_back(keypoint);
+        }
+    }
+    return keypoints;
+}
+
+cv::Mat AbstractSIFTVoronizer::run(cv::Mat& input)
+{
+    std::vector<cv::KeyPoint> keypoints = detectKeypoints(input);
+
+    // the single-scale detectors would lose all the keypoints or none of them
+    if (hasScale())
+        keypoints.erase(std::remove_if(keypoints.begin(), keypoints.end(),
+            [&](cv::KeyPoint x){return x.size < keypoint_size_treshold;}),
+        keypoints.end());
 
     cv::Mat im = drawGenerators(keypoints, input.size());
 
@@ -295,16 +549,56 @@ cv::Mat AbstractSIFTVoronizer::run(cv::Mat& input)
     m.convertTo(m, CV_8U);
     imshow(m, "m"); */
 
-    Voronoi voronoi;
-    voronoi.compute(im, im);
-
-    auto groups = voronoi.clear_groups();
+    auto groups = computeVoronoi(im, im);
     return colorize_funct(input, im, &*groups);
 }
 
 AbstractSIFTVoronizer::AbstractSIFTVoronizer(size_t keypoint_size_treshold)
 {
     this->keypoint_size_treshold = keypoint_size_treshold;
+    this->detector = KeypointDetector::sift;
+    this->detection_tile_size = 0;
+    this->detection_max_size = default_detection_max_size;
+}
+
+void AbstractSIFTVoronizer::set_detection_tiles(int detection_tile_size, int detection_max_size)
+{
+    this->detection_tile_size = detection_tile_size;
+    this->detection_max_size = detection_max_size;
+}
+
+void AbstractSIFTVoronizer::set_detector(KeypointDetector detector)
+{
+    this->detector = detector;
+    if (!hasScale() && keypoint_size_treshold > corner_keypoint_size)
+        cerr << "Warning: All the keypoints of the selected detector have size " << corner_keypoint_size
+             << ", KEYPOINT_SIZE_TRESHOLD " << keypoint_size_treshold << " is ignored." << endl;
+}
+
+bool AbstractSIFTVoronizer::hasScale() const
+{
+    return detector == KeypointDetector::sift || detector == KeypointDetector::orb;
+}
+
+cv::Ptr<cv::Feature2D> AbstractSIFTVoronizer::createDetector(double share) const
+{
+    const int max_keypoints = std::max(1, (int)std::lround(5000 * share));
+    // the corner detectors are much faster than SIFT (no scale space, orientations and descriptors), their thresholds
+    // are set to give roughly the same number of keypoints
+    switch (detector)
+    {
+    case KeypointDetector::fast:
+        return cv::FastFeatureDetector::create(20, true, cv::FastFeatureDetector::TYPE_9_16);
+    case KeypointDetector::agast:
+        return cv::AgastFeatureDetector::create(20, true, cv::AgastFeatureDetector::OAST_9_16);
+    case KeypointDetector::gftt:
+        // the size of GFTT keypoints is the block size, 7 is the same as the size of FAST keypoints
+        return cv::GFTTDetector::create(max_keypoints, 0.01, 3, (int)corner_keypoint_size);
+    case KeypointDetector::orb:
+        return cv::ORB::create(max_keypoints);
+    default:
+        return cv::SIFT::create(0, 3, 0.03, 10, 1.6);
+    }
 }
 
 
@@ -349,8 +643,8 @@ std::unique_ptr<SIFTVoronizerCircles> SIFTVoronizerCircles::create(const std::st
 
 cv::Mat SIFTVoronizerCircles::drawGenerators(std::vector<cv::KeyPoint> keypoints, cv::Size image_size)
 {
-    cv::Mat data = cv::Mat::zeros(image_size, CV_16S);
-    int16_t n = 1;
+    cv::Mat data = cv::Mat::zeros(image_size, label_depth((int64_t)keypoints.size()));
+    int n = 1;
     if (radius < 0)
         for (auto& k : keypoints)
             cv::circle(data, k.pt, (int)(k.size*radius_multiplier), n++, thickness);
@@ -380,9 +674,6 @@ std::unique_ptr<SIFTVoronizerLines> SIFTVoronizerLines::create(const std::string
     if (vec.size() >= 2 && vec[1].size() != 0 && !tryParse<size_t>(vec[1], n_iter))
         return nullptr;
 
-    if (n_iter == 0)
-        return nullptr;
-    
     return make_unique<SIFTVoronizerLines>(keypoint_size_treshold, n_iter);
 }
 
@@ -392,5 +683,7 @@ cv::Mat SIFTVoronizerLines::drawGenerators(std::vector<cv::KeyPoint> keypoints,
     pts.reserve(keypoints.size());
     for (auto& x : keypoints)
         pts.push_back(move(x.pt));
-    return linesFromClosestPointsRandom(pts, image_size, n_iter);   
+    if (n_iter == 0)
+        return linesFromClosestPoints(pts, image_size, seed);
+    return linesFromClosestPointsRandom(pts, image_size, n_iter);
 }
\ No newline at end of file
@@ -1,5 +1,11 @@
 #include "voronoi.hpp"
 
+#include <limits>
+#include <algorithm>
+#include <stdexcept>
+
+#include "simd.hpp"
+
 using namespace std;
 
 
@@ -8,34 +14,418 @@ Voronoi::Voronoi() : Growing(Neighborhood::alternating)
 
 }
 
-void Voronoi::init_funct(set<Pixel*>& opened, cv::Mat& output, bool create_new_pixelmat)
+size_t Voronoi::compute_inner(cv::Mat& data, bool create_new_state_plane)
+{
+    return compute_with_kernel<NeighborhoodAlternating>(data, create_new_state_plane, GrowToUnseen());
+}
+
+void Voronoi::init_funct(Frontier& opened, cv::Mat& output, bool create_new_state_plane)
+{
+    if (create_new_state_plane)
+        state_plane = make_unique<StatePlane>(output.rows-2, output.cols-2);
+
+    StatePlane& states = *state_plane;
+    with_label_type(output.depth(), [&](auto label)
+    {
+        using label_t = decltype(label);
+        const label_t* values = output.ptr<label_t>();
+        for (int row = 0; row < states.rows; ++row)
+        {
+            for (int col = 0; col < states.cols; ++col)
+            {
+                pixel_idx_t pixel = states.index(row, col);
+                if (values[pixel] != 0)
+                {
+                    states[pixel] = State::opened;
+                    opened.open(pixel);
+                }
+                else
+                {
+                    states[pixel] = State::unseen;
+                }
+            }
+        }
+    });
+}
+
+
+
+EDTVoronoi::EDTVoronoi()
+{}
+
+std::unique_ptr<Groups> EDTVoronoi::clear_groups()
+{
+    auto g = move(groups);
+    groups = nullptr;
+    return g;
+}
+
+void EDTVoronoi::compute(const cv::Mat& input_data, cv::Mat& output_data)
+{
+    assert(input_data.depth() == CV_16S || input_data.depth() == CV_32S);
+
+    cv::Mat nearest_row(input_data.size(), CV_32S);
+    cv::Mat output(input_data.size(), input_data.type());
+    with_label_type(input_data.depth(), [&](auto label)
+    {
+        nearest_in_columns<decltype(label)>(input_data, nearest_row);
+        nearest_in_rows<decltype(label)>(input_data, nearest_row, output);
+    });
+
+    groups = make_unique<Groups>(output);
+    output_data = output;
+}
+
+template <typename label_t>
+void EDTVoronoi::nearest_in_columns(const cv::Mat& input, cv::Mat& nearest_row)
+{
+    // Each thread takes a band of columns and sweeps it row by row (so the memory is accessed sequentially)
+    cv::parallel_for_(cv::Range(0, input.cols), [&](const cv::Range& range)
+    {
+        // top-down sweep: the nearest generator above (or at) the pixel
+        for (int row = 0; row < input.rows; ++row)
+        {
+            const label_t* values = input.ptr<label_t>(row);
+            int* nearest = nearest_row.ptr<int>(row);
+            const int* nearest_above = row > 0 ? nearest_row.ptr<int>(row-1) : nullptr;
+            for (int col = range.start; col < range.end; ++col)
+            {
+                if (values[col] != 0)
+                    nearest[col] = row;
+                else
+                    nearest[col] = nearest_above != nullptr ? nearest_above[col] : -1;
+            }
+        }
+
+        // bottom-up sweep: replace it by the generator below if it is closer
+        for (int row = input.rows-2; row >= 0; --row)
+        {
+            int* nearest = nearest_row.ptr<int>(row);
+            const int* nearest_below = nearest_row.ptr<int>(row+1);
+            for (int col = range.start; col < range.end; ++col)
+            {
+                int below = nearest_below[col];
+                if (below >= 0 && (nearest[col] < 0 || below - row < row - nearest[col]))
+                    nearest[col] = below;
+            }
+        }
+    });
+}
+
+template <typename label_t>
+void EDTVoronoi::nearest_in_rows(const cv::Mat& input, const cv::Mat& nearest_row, cv::Mat& output)
+{
+    const double inf = std::numeric_limits<double>::infinity();
+
+    cv::parallel_for_(cv::Range(0, input.rows), [&](const cv::Range& range)
+    {
+        // lower envelope of parabolas: locations of parabolas (v) and boundaries between them (z)
+        std::vector<int> v(input.cols);
+        std::vector<double> z(input.cols + 1);
+        std::vector<double> f(input.cols);
+
+        for (int row = range.start; row < range.end; ++row)
+        {
+            const int* nearest = nearest_row.ptr<int>(row);
+            label_t* labels = output.ptr<label_t>(row);
+
+            // squared distance to the nearest generator in each column (columns without generators are skipped)
+            int k = -1;
+            for (int q = 0; q < input.cols; ++q)
+            {
+                if (nearest[q] < 0)
+                    continue;
+                f[q] = (double)(row - nearest[q]) * (row - nearest[q]);
+
+                if (k < 0)
+                {
+                    k = 0;
+                    v[0] = q;
+                    z[0] = -inf;
+                    z[1] = inf;
+                    continue;
+                }
+
+                double s = ((f[q] + (double)q*q) - (f[v[k]] + (double)v[k]*v[k])) / (2.0*q - 2.0*v[k]);
+                while (s <= z[k])
+                {
+                    --k;
+                    s = ((f[q] + (double)q*q) - (f[v[k]] + (double)v[k]*v[k])) / (2.0*q - 2.0*v[k]);
+                }
+                ++k;
+                v[k] = q;
+                z[k] = s;
+                z[k+1] = inf;
+            }
+
+            // there are no generators at all
+            if (k < 0)
+            {
+                std::fill_n(labels, input.cols, (label_t)0);
+                continue;
+            }
+
+            k = 0;
+            for (int col = 0; col < input.cols; ++col)
+            {
+                while (z[k+1] < col)
+                    ++k;
+                int q = v[k];
+                labels[col] = input.at<label_t>(nearest[q], q);
+            }
+        }
+    });
+}
+
+
+// Position of a generator pixel packed as (row << 16) | col (both fit to 15 bits), so the difference of two positions
+// can be computed by one 16-bit subtraction and its squared length by one multiply-add
+static constexpr int32_t no_seed = -1;
+static constexpr int jfa_max_size = numeric_limits<int16_t>::max();
+static inline int32_t pack_seed(int row, int col) { return (int32_t)(((uint32_t)row << 16) | (uint32_t)col); }
+static inline int seed_row(int32_t seed) { return (int)((uint32_t)seed >> 16); }
+static inline int seed_col(int32_t seed) { return (int)(seed & 0xFFFF); }
+
+/*
+Row kernels of the jump flooding - compare the generators in 'candidates' with the nearest generators found so far
+('seeds' with squared distances 'dist') for the pixels [begin, end) of the row and keep the closer ones
+(on tie the generator found first is kept). The candidate of pixel col is candidates[col + shift].
+All kernels give the same results.
+*/
+typedef void (*jfa_row_funct_t)(const int32_t* candidates, int shift, int32_t* seeds, int32_t* dist, int row, int begin, int end);
+
+static void jfa_row_scalar(const int32_t* candidates, int shift, int32_t* seeds, int32_t* dist, int row, int begin, int end)
+{
+    for (int col = begin; col < end; ++col)
+    {
+        int32_t seed = candidates[col + shift];
+        if (seed == no_seed)
+            continue;
+
+        int d_row = row - seed_row(seed);
+        int d_col = col - seed_col(seed);
+        int32_t d = d_row*d_row + d_col*d_col;
+        if (d < dist[col])
+        {
+            dist[col] = d;
+            seeds[col] = seed;
+        }
+    }
+}
+
+#ifdef VORONIZER_AVX2
+VORONIZER_TARGET("avx2")
+static void jfa_row_avx2(const int32_t* candidates, int shift, int32_t* seeds, int32_t* dist, int row, int begin, int end)
+{
+    const __m256i none = _mm256_set1_epi32(no_seed);
+    const __m256i max_dist = _mm256_set1_epi32(numeric_limits<int32_t>::max());
+    const __m256i lanes = _mm256_set1_epi32(8);
+    __m256i position = _mm256_add_epi32(_mm256_set1_epi32(pack_seed(row, begin)), _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7));
+
+    int col = begin;
+    for (; col + 8 <= end; col += 8)
+    {
+        __m256i seed = _mm256_loadu_si256((const __m256i*)(candidates + col + shift));
+        __m256i delta = _mm256_sub_epi16(position, seed);
+        __m256i d = _mm256_madd_epi16(delta, delta);
+        d = _mm256_blendv_epi8(d, max_dist, _mm256_cmpeq_epi32(seed, none));
+
+        __m256i old_d = _mm256_loadu_si256((const __m256i*)(dist + col));
+        __m256i closer = _mm256_cmpgt_epi32(old_d, d);
+        _mm256_storeu_si256((__m256i*)(dist + col), _mm256_blendv_epi8(old_d, d, closer));
+        __m256i old_seed = _mm256_loadu_si256((const __m256i*)(seeds + col));
+        _mm256_storeu_si256((__m256i*)(seeds + col), _mm256_blendv_epi8(old_seed, seed, closer));
+
+        position = _mm256_add_epi32(position, lanes);
+    }
+    jfa_row_scalar(candidates, shift, seeds, dist, row, col, end);
+}
+#endif
+
+#ifdef VORONIZER_SSE41
+VORONIZER_TARGET("sse4.1")
+static void jfa_row_sse41(const int32_t* candidates, int shift, int32_t* seeds, int32_t* dist, int row, int begin, int end)
 {
-    if (create_new_pixelmat)
+    const __m128i none = _mm_set1_epi32(no_seed);
+    const __m128i max_dist = _mm_set1_epi32(numeric_limits<int32_t>::max());
+    const __m128i lanes = _mm_set1_epi32(4);
+    __m128i position = _mm_add_epi32(_mm_set1_epi32(pack_seed(row, begin)), _mm_setr_epi32(0, 1, 2, 3));
+
+    int col = begin;
+    for (; col + 4 <= end; col += 4)
     {
-        pixel_mat = make_unique<PixelMat>(
-            output.rows, vector<Pixel>(
-            output.cols, Pixel(0, 0, State::unseen)
-        ));
+        __m128i seed = _mm_loadu_si128((const __m128i*)(candidates + col + shift));
+        __m128i delta = _mm_sub_epi16(position, seed);
+        __m128i d = _mm_madd_epi16(delta, delta);
+        d = _mm_blendv_epi8(d, max_dist, _mm_cmpeq_epi32(seed, none));
+
+        __m128i old_d = _mm_loadu_si128((const __m128i*)(dist + col));
+        __m128i closer = _mm_cmpgt_epi32(old_d, d);
+        _mm_storeu_si128((__m128i*)(dist + col), _mm_blendv_epi8(old_d, d, closer));
+        __m128i old_seed = _mm_loadu_si128((const __m128i*)(seeds + col));
+        _mm_storeu_si128((__m128i*)(seeds + col), _mm_blendv_epi8(old_seed, seed, closer));
+
+        position = _mm_add_epi32(position, lanes);
     }
+    jfa_row_scalar(candidates, shift, seeds, dist, row, col, end);
+}
+#endif
+
+// Select the widest kernel supported by the CPU
+static jfa_row_funct_t select_jfa_row_funct()
+{
+#ifdef VORONIZER_AVX2
+    if (cv::checkHardwareSupport(CV_CPU_AVX2))
+        return jfa_row_avx2;
+#endif
+#ifdef VORONIZER_SSE41
+    if (cv::checkHardwareSupport(CV_CPU_SSE4_1))
+        return jfa_row_sse41;
+#endif
+    return jfa_row_scalar;
+}
+
+
+JFAVoronoi::JFAVoronoi(bool extra_pass) : extra_pass(extra_pass)
+{}
+
+std::unique_ptr<Groups> JFAVoronoi::clear_groups()
+{
+    auto g = move(groups);
+    groups = nullptr;
+    return g;
+}
+
+void JFAVoronoi::compute(const cv::Mat& input_data, cv::Mat& output_data)
+{
+    assert(input_data.depth() == CV_16S || input_data.depth() == CV_32S);
+    if (input_data.rows > jfa_max_size || input_data.cols > jfa_max_size)
+        throw logic_error("Error: JFAVoronoi supports images with at most " + to_string(jfa_max_size) + " rows and columns!");
 
-    for (int row = 0; row < output.rows; ++row)
-        for (int col = 0; col < output.cols; ++col)
+    cv::Mat seeds(input_data.size(), CV_32S);
+    cv::Mat buffer(input_data.size(), CV_32S);
+    with_label_type(input_data.depth(), [&](auto label)
+    {
+        using label_t = decltype(label);
+        cv::parallel_for_(cv::Range(0, input_data.rows), [&](const cv::Range& range)
         {
-            Pixel* pixel = &(*pixel_mat)[row][col];
-            if (create_new_pixelmat)
+            for (int row = range.start; row < range.end; ++row)
             {
-                pixel->row = row;
-                pixel->col = col;
+                const label_t* values = input_data.ptr<label_t>(row);
+                int32_t* seed = seeds.ptr<int32_t>(row);
+                for (int col = 0; col < input_data.cols; ++col)
+                    seed[col] = values[col] != 0 ? pack_seed(row, col) : no_seed;
             }
+        });
+    });
+
+    // the first step is the largest power of two less than the size of the image
+    int step = 1;
+    while (step * 2 < max(input_data.rows, input_data.cols))
+        step *= 2;
+
+    if (extra_pass)
+    {
+        jump(seeds, buffer, 1);
+        swap(seeds, buffer);
+    }
+    for (; step >= 1; step /= 2)
+    {
+        jump(seeds, buffer, step);
+        swap(seeds, buffer);
+    }
 
-            if (output.at<int_t>(row,col) != 0)
+    cv::Mat output(input_data.size(), input_data.type());
+    with_label_type(input_data.depth(), [&](auto label)
+    {
+        using label_t = decltype(label);
+        cv::parallel_for_(cv::Range(0, input_data.rows), [&](const cv::Range& range)
+        {
+            for (int row = range.start; row < range.end; ++row)
             {
-                pixel->state = State::opened;
-                opened.insert(pixel);
+                const int32_t* seed = seeds.ptr<int32_t>(row);
+                label_t* labels = output.ptr<label_t>(row);
+                for (int col = 0; col < input_data.cols; ++col)
+                    labels[col] = seed[col] != no_seed ? input_data.at<label_t>(seed_row(seed[col]), seed_col(seed[col])) : 0;
             }
-            else
+        });
+    });
+
+    groups = make_unique<Groups>(output);
+    output_data = output;
+}
+
+void JFAVoronoi::jump(const cv::Mat& src, cv::Mat& dst, int step)
+{
+    static const jfa_row_funct_t update_row = select_jfa_row_funct();
+
+    // Each thread takes a band of rows, the pixel itself is compared first (so it keeps its generator on ties)
+    // and then its 8 neighbors in distance 'step'
+    cv::parallel_for_(cv::Range(0, src.rows), [&](const cv::Range& range)
+    {
+        std::vector<int32_t> dist(src.cols);
+        for (int row = range.start; row < range.end; ++row)
+        {
+            int32_t* seeds = dst.ptr<int32_t>(row);
+            std::fill_n(seeds, src.cols, no_seed);
+            std::fill(dist.begin(), dist.end(), numeric_limits<int32_t>::max());
+
+            update_row(src.ptr<int32_t>(row), 0, seeds, dist.data(), row, 0, src.cols);
+            for (int i = 0; i < NeighborOffsets::n8_size; ++i)
             {
-                pixel->state = State::unseen;
+                int other_row = row + NeighborOffsets::n8_rows[i] * step;
+                int shift = NeighborOffsets::n8_cols[i] * step;
+                if (other_row < 0 || other_row >= src.rows)
+                    continue;
+
+                int begin = max(0, -shift);
+                int end = min(src.cols, src.cols - shift);
+                if (begin < end)
+                    update_row(src.ptr<int32_t>(other_row), shift, seeds, dist.data(), row, begin, end);
             }
         }
+    });
+}
+
+
+VoronoiDifference compareVoronoi(const cv::Mat& output, const cv::Mat& reference)
+{
+    assert(output.size() == reference.size());
+    assert(output.depth() == reference.depth());
+
+    // groups store linear pixel indices, so we need continuous memory to address the pixels
+    cv::Mat values_mat = output.isContinuous() ? output : output.clone();
+    cv::Mat reference_mat = reference.isContinuous() ? reference : reference.clone();
+    Groups cells(reference_mat);
+
+    VoronoiDifference difference;
+    difference.pixels = reference_mat.total();
+    difference.cells = cells.size();
+    with_label_type(reference_mat.depth(), [&](auto label)
+    {
+        using label_t = decltype(label);
+        const label_t* values = values_mat.ptr<label_t>();
+        const label_t* reference_values = reference_mat.ptr<label_t>();
+        for (size_t pixel = 0; pixel < difference.pixels; ++pixel)
+            difference.different_pixels += values[pixel] != reference_values[pixel];
+
+        for (auto cell : cells)
+            for (auto pixel : cell)
+                if (values[pixel] != reference_values[pixel])
+                {
+                    ++difference.different_cells;
+                    break;
+                }
+    });
+    return difference;
+}
+
+std::ostream& operator<<(std::ostream& os, const VoronoiDifference& difference)
+{
+    auto percent = [](size_t part, size_t total) { return total > 0 ? 100.0 * part / total : 0.0; };
+    os << "different pixels: " << difference.different_pixels << " / " << difference.pixels
+       << " (" << percent(difference.different_pixels, difference.pixels) << " %), "
+       << "different cells: " << difference.different_cells << " / " << difference.cells
+       << " (" << percent(difference.different_cells, difference.cells) << " %)";
+    return os;
 }
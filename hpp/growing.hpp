@@ -1,65 +1,683 @@
 #ifndef GROWING_HPP
 #define GROWING_HPP
 
-#include <set>
 #include <vector>
+#include <cassert>
 #include <opencv2/core.hpp>
 #include <map>
 #include <memory>
+#include <atomic>
+#include <algorithm>
+#include <limits>
 
 typedef int16_t int_t;
+typedef uint32_t pixel_idx_t;
+
+/*
+Labels (values of the regions/generators) are stored in 16-bit images (CV_16S, int_t) by default, images with more
+than 32767 labels use 32-bit images (CV_32S). Functions working with labels select the type by the depth of the image.
+*/
+// Depth of the label image that can store labels up to max_label
+inline int label_depth(int64_t max_label) { return max_label <= std::numeric_limits<int_t>::max() ? CV_16S : CV_32S; }
+
+// Calls funct with a value of the label type of given depth (int_t for CV_16S, int32_t for CV_32S), use as
+// with_label_type(image.depth(), [&](auto label) { using label_t = decltype(label); ... });
+template <typename Funct>
+decltype(auto) with_label_type(int depth, Funct&& funct)
+{
+    assert(depth == CV_16S || depth == CV_32S);
+    if (depth == CV_32S)
+        return funct(int32_t());
+    return funct(int_t());
+}
 enum Neighborhood {n4, n8, alternating};
-enum State {unseen, opened, closed};
+// 'claimed' marks pixels opened during the current step of the parallel growing (see grow_parallel)
+enum State : uint8_t {unseen, opened, closed, claimed};
+
+// Access to the state for concurrent reads and updates (used only by the parallel growing)
+inline std::atomic<State>& atomic_state(State& state)
+{
+    static_assert(sizeof(std::atomic<State>) == sizeof(State), "atomic state must have the same size as the state");
+    return reinterpret_cast<std::atomic<State>&>(state);
+}
 
-struct Pixel
+/*
+Flat plane keeping the state of every pixel of the image (one byte per pixel).
+The plane is padded by a one pixel wide border of 'closed' sentinel pixels, so the neighbors of any image pixel
+can be visited without checking the image borders (the growing never enters a 'closed' pixel).
+Pixels are addressed by their linear (row-major) index in the padded plane, i.e. index = (row+1)*stride + col+1.
+*/
+class StatePlane
 {
-    Pixel(int row, int col, State state);
-    friend bool operator<(const Pixel& lhs, const Pixel& rhs);
+public:
+    int rows;
+    int cols;
+    int stride;
+    std::vector<State> state;
+
+    StatePlane(int rows, int cols, State init = State::unseen);
 
-    int row;
-    int col;
-    State state;
+    pixel_idx_t index(int row, int col) const { return (pixel_idx_t)(row+1) * stride + col+1; }
+    int row(pixel_idx_t index) const { return (int)(index / stride) - 1; }
+    int col(pixel_idx_t index) const { return (int)(index % stride) - 1; }
+    size_t size() const { return state.size(); }
+
+    // Conversion between index in the padded plane and index in the (unpadded) image, i.e. row*cols + col
+    pixel_idx_t to_image_index(pixel_idx_t index) const { return (pixel_idx_t)row(index) * cols + col(index); }
+    pixel_idx_t from_image_index(pixel_idx_t index) const { return this->index((int)(index / cols), (int)(index % cols)); }
+
+    State& operator[](pixel_idx_t index) { return state[index]; }
+    const State& operator[](pixel_idx_t index) const { return state[index]; }
 };
 
-typedef std::map<int, std::vector<Pixel*>> Groups;
-typedef std::vector<std::vector<Pixel>> PixelMat;
+/*
+Offsets of linear indices of the neighbors in a plane with given row stride.
+The neighbors are always visited in the same order - for 4-neighborhood: up, down, left, right
+and for 8-neighborhood row by row from the top-left to the bottom-right neighbor.
+*/
+class NeighborOffsets
+{
+public:
+    static constexpr int n4_size = 4;
+    static constexpr int n8_size = 8;
+    static constexpr int n4_rows[n4_size] = {-1, 1,  0, 0};
+    static constexpr int n4_cols[n4_size] = { 0, 0, -1, 1};
+    static constexpr int n8_rows[n8_size] = {-1, -1, -1,  0, 0,  1, 1, 1};
+    static constexpr int n8_cols[n8_size] = {-1,  0,  1, -1, 1, -1, 0, 1};
+
+    std::ptrdiff_t n4[n4_size];
+    std::ptrdiff_t n8[n8_size];
+
+    NeighborOffsets(int stride);
+
+    // Offsets of 4-neighborhood (if bool_4_8 is true) or 8-neighborhood
+    const std::ptrdiff_t* begin(bool bool_4_8) const { return bool_4_8 ? n4 : n8; }
+    const std::ptrdiff_t* end(bool bool_4_8) const { return bool_4_8 ? n4 + n4_size : n8 + n8_size; }
+};
+
+/*
+Linear indices (in the image, i.e. row*cols + col) of pixels belonging to each group (value) in compressed sparse row
+format: pixels of all groups are stored in one array ordered by the groups, the pixels of i-th group (with value
+values[i]) are pixels[offsets[i]] .. pixels[offsets[i+1]-1]. The groups are ordered by their values, the pixels
+of each group by their index. It is built from an image of values by counting sort in two linear passes.
+*/
+class Groups
+{
+public:
+    // Pixels of one group
+    class Group
+    {
+    public:
+        int value;
+
+        Group(int value, const pixel_idx_t* first, const pixel_idx_t* last) : value(value), first(first), last(last) {}
+        const pixel_idx_t* begin() const { return first; }
+        const pixel_idx_t* end() const { return last; }
+        size_t size() const { return last - first; }
+    private:
+        const pixel_idx_t* first;
+        const pixel_idx_t* last;
+    };
+
+    class const_iterator
+    {
+    public:
+        const_iterator(const Groups& groups, size_t i) : groups(groups), i(i) {}
+        Group operator*() const { return groups[i]; }
+        const_iterator& operator++() { ++i; return *this; }
+        bool operator!=(const const_iterator& other) const { return i != other.i; }
+    private:
+        const Groups& groups;
+        size_t i;
+    };
+
+    std::vector<int> values;
+    std::vector<pixel_idx_t> offsets;
+    std::vector<pixel_idx_t> pixels;
+
+    // Empty groups
+    Groups();
+    // Groups of pixels with the same value in labels (CV_16S or CV_32S), pixels with value 0 are skipped
+    Groups(const cv::Mat& labels);
+
+    size_t size() const { return values.size(); }
+    Group operator[](size_t i) const { return Group(values[i], pixels.data() + offsets[i], pixels.data() + offsets[i+1]); }
+    const_iterator begin() const { return const_iterator(*this, 0); }
+    const_iterator end() const { return const_iterator(*this, size()); }
+};
+
+/*
+Open pixels of the region growing stored as two contiguous buffers of linear pixel indices (in StatePlane).
+Pixels opened during one step are appended to the 'next' buffer, which becomes the 'current' buffer
+in the following step (the buffers are swapped, so their memory is reused for the whole computation).
+Each pixel is opened at most once, as the duplicates are filtered by the 'State' flag before opening.
+The pixels are processed in the order in which they were opened (FIFO), so the order is deterministic.
+*/
+class Frontier
+{
+public:
+    // Pixels processed in the current step
+    std::vector<pixel_idx_t> current;
+    // Pixels opened during the current step
+    std::vector<pixel_idx_t> next;
+
+    // Mark pixel to be processed in the next step
+    void open(pixel_idx_t index) { next.push_back(index); }
+    // Move to the next step, returns false if there are no pixels left to process
+    bool advance();
+    // Remove all pixels from both buffers (keeps the allocated memory)
+    void clear();
+};
+
+/*
+Neighborhood policies of the growing kernel - select 4-neighborhood (true) or 8-neighborhood (false) for given step
+*/
+struct Neighborhood4
+{
+    static constexpr bool use_n4(size_t step) { return true; }
+};
+struct Neighborhood8
+{
+    static constexpr bool use_n4(size_t step) { return false; }
+};
+// Alternates the neighborhoods, starting with 8-neighborhood
+struct NeighborhoodAlternating
+{
+    static constexpr bool use_n4(size_t step) { return step % 2 == 1; }
+};
+
+/*
+Condition policies of the growing kernel - decide if the value of the pixel should be assigned to its neighbor
+(the kernel asks only for the 'unseen' neighbors) and do the assignment.
+*/
+// Every unseen neighbor takes the value of the pixel
+struct GrowToUnseen
+{
+    bool condition(pixel_idx_t pixel, pixel_idx_t neighbor) const { return true; }
+
+    template <typename label_t>
+    void assign(label_t* labels, pixel_idx_t pixel, pixel_idx_t neighbor) const { labels[neighbor] = labels[pixel]; }
+};
+
+// Grows only to neighbors with the same value in the input (addressed by the same indices as the labels)
+template <typename input_t>
+struct GrowToSameValue : public GrowToUnseen
+{
+    const input_t* input;
+
+    GrowToSameValue(const input_t* input) : input(input) {}
+    bool condition(pixel_idx_t pixel, pixel_idx_t neighbor) const { return input[pixel] == input[neighbor]; }
+};
+
+// One step of the growing kernel with fixed size of the neighborhood (see grow)
+template <typename label_t, int n_neighbors, typename ConditionPolicy>
+inline void grow_step(
+    Frontier& frontier,
+    StatePlane& states,
+    label_t* labels,
+    const std::ptrdiff_t (&offsets)[n_neighbors],
+    const ConditionPolicy& policy,
+    std::vector<pixel_idx_t>& processed)
+{
+    State* state = states.state.data();
+    for (auto pixel : frontier.current)
+    {
+        for (int i = 0; i < n_neighbors; ++i)
+        {
+            pixel_idx_t neighbor = (pixel_idx_t)(pixel + offsets[i]);
+            if (state[neighbor] == State::unseen && policy.condition(pixel, neighbor))
+            {
+                frontier.open(neighbor);
+                policy.assign(labels, pixel, neighbor);
+                state[neighbor] = State::opened;
+            }
+        }
+
+        state[pixel] = State::closed;
+    }
+    processed.insert(processed.end(), frontier.current.begin(), frontier.current.end());
+}
+
+/*
+Region growing kernel - grows the labels from the pixels opened in frontier until there are no opened pixels left.
+Labels are addressed by the indices of the (padded) state plane, all pixels processed during the growing are appended
+to 'processed'. Returns number of steps. The neighborhood and the condition are compile-time policies, so the calls
+in the inner loop can be inlined.
+*/
+template <typename label_t, typename NeighborhoodPolicy, typename ConditionPolicy>
+size_t grow(
+    Frontier& frontier,
+    StatePlane& states,
+    label_t* labels,
+    const ConditionPolicy& policy,
+    std::vector<pixel_idx_t>& processed)
+{
+    const NeighborOffsets offsets(states.stride);
+    size_t steps = 0;
+    while (frontier.advance())
+    {
+        if (NeighborhoodPolicy::use_n4(steps))
+            grow_step(frontier, states, labels, offsets.n4, policy, processed);
+        else
+            grow_step(frontier, states, labels, offsets.n8, policy, processed);
+        steps += 1;
+    }
+    return steps;
+}
+
+/*
+Parallel version of one step of the growing kernel (see grow_parallel). The frontier is split into chunks of fixed size,
+claimed[c] collects the pixels claimed from chunk c, first[c] is the position of these pixels in the next frontier.
+*/
+template <typename label_t, int n_neighbors, typename ConditionPolicy>
+void grow_step_parallel(
+    Frontier& frontier,
+    StatePlane& states,
+    label_t* labels,
+    const std::ptrdiff_t (&offsets)[n_neighbors],
+    const ConditionPolicy& policy,
+    std::vector<pixel_idx_t>& processed,
+    std::vector<std::vector<pixel_idx_t>>& claimed,
+    std::vector<size_t>& first)
+{
+    constexpr size_t chunk_size = 4096;
+    const std::vector<pixel_idx_t>& current = frontier.current;
+    const size_t n_chunks = (current.size() + chunk_size - 1) / chunk_size;
+    if (claimed.size() < n_chunks)
+        claimed.resize(n_chunks);
+    State* state = states.state.data();
+
+    // 1. claim the unseen neighbors satisfying the condition - every pixel is claimed by exactly one thread
+    cv::parallel_for_(cv::Range(0, (int)n_chunks), [&](const cv::Range& range)
+    {
+        for (int c = range.start; c < range.end; ++c)
+        {
+            claimed[c].clear();
+            size_t end = std::min(current.size(), (c+1) * chunk_size);
+            for (size_t i = c * chunk_size; i < end; ++i)
+            {
+                pixel_idx_t pixel = current[i];
+                for (int j = 0; j < n_neighbors; ++j)
+                {
+                    pixel_idx_t neighbor = (pixel_idx_t)(pixel + offsets[j]);
+                    State expected = State::unseen;
+                    if (atomic_state(state[neighbor]).load(std::memory_order_relaxed) == State::unseen
+                        && policy.condition(pixel, neighbor)
+                        && atomic_state(state[neighbor]).compare_exchange_strong(expected, State::claimed, std::memory_order_relaxed))
+                        claimed[c].push_back(neighbor);
+                }
+            }
+        }
+    });
+
+    // 2. assign the claimed pixels the lowest label of their neighbors in the frontier (independent on who claimed them)
+    cv::parallel_for_(cv::Range(0, (int)n_chunks), [&](const cv::Range& range)
+    {
+        for (int c = range.start; c < range.end; ++c)
+        {
+            for (auto pixel : claimed[c])
+            {
+                pixel_idx_t source = pixel;
+                for (int j = 0; j < n_neighbors; ++j)
+                {
+                    pixel_idx_t neighbor = (pixel_idx_t)(pixel + offsets[j]);
+                    if (state[neighbor] == State::opened && policy.condition(neighbor, pixel)
+                        && (source == pixel || labels[neighbor] < labels[source]))
+                        source = neighbor;
+                }
+                policy.assign(labels, source, pixel);
+            }
+        }
+    });
+
+    // 3. close the frontier, open the claimed pixels and copy them to the next frontier at the offsets of their chunks
+    // (the order of the next frontier depends on the threads, but the labels don't depend on the order, see grow_parallel)
+    first.resize(n_chunks + 1);
+    first[0] = frontier.next.size();
+    for (size_t c = 0; c < n_chunks; ++c)
+        first[c+1] = first[c] + claimed[c].size();
+    frontier.next.resize(first[n_chunks]);
+    const size_t processed_begin = processed.size();
+    processed.resize(processed_begin + current.size());
+    cv::parallel_for_(cv::Range(0, (int)n_chunks), [&](const cv::Range& range)
+    {
+        for (int c = range.start; c < range.end; ++c)
+        {
+            size_t end = std::min(current.size(), (c+1) * chunk_size);
+            for (size_t i = c * chunk_size; i < end; ++i)
+                state[current[i]] = State::closed;
+            std::copy(current.begin() + c * chunk_size, current.begin() + end, processed.begin() + processed_begin + c * chunk_size);
+            for (auto pixel : claimed[c])
+                state[pixel] = State::opened;
+            std::copy(claimed[c].begin(), claimed[c].end(), frontier.next.begin() + first[c]);
+        }
+    });
+}
+
+/*
+Multi-threaded region growing kernel with the same interface as grow. Each step is split into three parallel phases:
+the unseen neighbors of the frontier are claimed by atomic compare-and-swap of their state, then every claimed pixel
+takes the lowest label of its neighbors in the frontier (satisfying the condition) and finally the states are updated.
+Competing labels are resolved by this fixed rule instead of the processing order, so the result is the same for any
+number of threads (but it can differ from grow, where the pixel opened first wins). Only the order of the pixels in the
+frontier and in processed depends on the threads. The pixels in state 'opened' have to be exactly the pixels in the
+frontier, the policy has to be safe to call concurrently.
+*/
+template <typename label_t, typename NeighborhoodPolicy, typename ConditionPolicy>
+size_t grow_parallel(
+    Frontier& frontier,
+    StatePlane& states,
+    label_t* labels,
+    const ConditionPolicy& policy,
+    std::vector<pixel_idx_t>& processed)
+{
+    const NeighborOffsets offsets(states.stride);
+    std::vector<std::vector<pixel_idx_t>> claimed;
+    std::vector<size_t> first;
+    size_t steps = 0;
+    while (frontier.advance())
+    {
+        if (NeighborhoodPolicy::use_n4(steps))
+            grow_step_parallel(frontier, states, labels, offsets.n4, policy, processed, claimed, first);
+        else
+            grow_step_parallel(frontier, states, labels, offsets.n8, policy, processed, claimed, first);
+        steps += 1;
+    }
+    return steps;
+}
+
+/*
+Rectangular part of the image grown by grow_tiled. The tile keeps its own frontier and the pixels of the neighboring
+tiles reached from its frontier in the current step (halo), which are handed over to the neighboring tiles.
+*/
+class GrowingTile
+{
+public:
+    int row_begin, row_end, col_begin, col_end;
+    Frontier frontier;
+    std::vector<pixel_idx_t> processed;
+    // pairs (reached pixel, source pixel) sorted by the direction of the neighboring tile (index = 3*(d_row+1) + d_col+1)
+    std::vector<std::pair<pixel_idx_t, pixel_idx_t>> halo[9];
+
+    GrowingTile(int row_begin, int row_end, int col_begin, int col_end)
+    : row_begin(row_begin), row_end(row_end), col_begin(col_begin), col_end(col_end) {}
+
+    bool contains(int row, int col) const { return row >= row_begin && row < row_end && col >= col_begin && col < col_end; }
+    // Index of halo where the pixel outside of the tile belongs to
+    int direction(int row, int col) const
+    {
+        return 3 * (row < row_begin ? 0 : (row < row_end ? 1 : 2)) + (col < col_begin ? 0 : (col < col_end ? 1 : 2));
+    }
+    bool has_halo() const
+    {
+        for (auto& h : halo)
+            if (h.size() > 0)
+                return true;
+        return false;
+    }
+};
+
+// Grows the label from pixel to its neighbor in the same tile, the lowest label wins (see grow_parallel)
+template <typename label_t, typename ConditionPolicy>
+inline void grow_in_tile(GrowingTile& tile, State* state, label_t* labels, const ConditionPolicy& policy, pixel_idx_t pixel, pixel_idx_t neighbor)
+{
+    if (state[neighbor] == State::unseen)
+    {
+        if (policy.condition(pixel, neighbor))
+        {
+            state[neighbor] = State::claimed;
+            tile.frontier.open(neighbor);
+            policy.assign(labels, pixel, neighbor);
+        }
+    }
+    else if (state[neighbor] == State::claimed && labels[pixel] < labels[neighbor] && policy.condition(pixel, neighbor))
+        policy.assign(labels, pixel, neighbor);
+}
+
+// One step of the tiled growing kernel (see grow_tiled)
+template <typename label_t, int n_neighbors, typename ConditionPolicy>
+void grow_step_tiled(
+    std::vector<GrowingTile>& tiles,
+    int tiles_cols,
+    std::vector<int>& scheduled,
+    StatePlane& states,
+    label_t* labels,
+    const std::ptrdiff_t (&offsets)[n_neighbors],
+    const int (&offset_rows)[n_neighbors],
+    const int (&offset_cols)[n_neighbors],
+    const ConditionPolicy& policy)
+{
+    State* state = states.state.data();
+
+    // 1. every tile grows its frontier inside the tile, the pixels reached in other tiles are stored in its halo
+    // (tiles with empty frontier are scheduled only to clear the halo from the previous step)
+    scheduled.clear();
+    for (int t = 0; t < (int)tiles.size(); ++t)
+        if (tiles[t].frontier.current.size() > 0 || tiles[t].has_halo())
+            scheduled.push_back(t);
+
+    cv::parallel_for_(cv::Range(0, (int)scheduled.size()), [&](const cv::Range& range)
+    {
+        for (int i = range.start; i < range.end; ++i)
+        {
+            GrowingTile& tile = tiles[scheduled[i]];
+            for (auto& h : tile.halo)
+                h.clear();
+
+            for (auto pixel : tile.frontier.current)
+            {
+                int row = states.row(pixel);
+                int col = states.col(pixel);
+                for (int j = 0; j < n_neighbors; ++j)
+                {
+                    int neighbor_row = row + offset_rows[j];
+                    int neighbor_col = col + offset_cols[j];
+                    pixel_idx_t neighbor = (pixel_idx_t)(pixel + offsets[j]);
+                    if (tile.contains(neighbor_row, neighbor_col))
+                        grow_in_tile(tile, state, labels, policy, pixel, neighbor);
+                    else if (neighbor_row >= 0 && neighbor_row < states.rows && neighbor_col >= 0 && neighbor_col < states.cols)
+                        tile.halo[tile.direction(neighbor_row, neighbor_col)].emplace_back(neighbor, pixel);
+                }
+            }
+        }
+    }, (double)scheduled.size());
+
+    // 2. every tile takes the pixels from the halos of its neighbors and updates the states
+    std::vector<char> receives(tiles.size(), 0);
+    for (int t = 0; t < (int)tiles.size(); ++t)
+    {
+        if (tiles[t].frontier.current.size() > 0)
+            receives[t] = 1;
+        for (int d = 0; d < 9; ++d)
+            if (tiles[t].halo[d].size() > 0)
+                receives[t + (d/3 - 1) * tiles_cols + (d%3 - 1)] = 1;
+    }
+    scheduled.clear();
+    for (int t = 0; t < (int)tiles.size(); ++t)
+        if (receives[t])
+            scheduled.push_back(t);
+
+    const int tiles_rows = (int)tiles.size() / tiles_cols;
+    cv::parallel_for_(cv::Range(0, (int)scheduled.size()), [&](const cv::Range& range)
+    {
+        for (int i = range.start; i < range.end; ++i)
+        {
+            int t = scheduled[i];
+            GrowingTile& tile = tiles[t];
+            int tile_row = t / tiles_cols;
+            int tile_col = t % tiles_cols;
+            for (int d = 0; d < 9; ++d)
+            {
+                // the neighboring tile in the opposite direction
+                int source_row = tile_row - (d/3 - 1);
+                int source_col = tile_col - (d%3 - 1);
+                if (d == 4 || source_row < 0 || source_row >= tiles_rows || source_col < 0 || source_col >= tiles_cols)
+                    continue;
+                for (auto& reached : tiles[source_row * tiles_cols + source_col].halo[d])
+                    grow_in_tile(tile, state, labels, policy, reached.second, reached.first);
+            }
+
+            for (auto pixel : tile.frontier.current)
+                state[pixel] = State::closed;
+            for (auto pixel : tile.frontier.next)
+                state[pixel] = State::opened;
+            tile.processed.insert(tile.processed.end(), tile.frontier.current.begin(), tile.frontier.current.end());
+        }
+    }, (double)scheduled.size());
+}
+
+/*
+Tiled region growing kernel with the same interface and the same result as grow_parallel. The image is split into
+square tiles of given size, each with its own frontier, so the growing works on a small part of the memory at a time.
+In each step every tile grows its frontier and hands the pixels reached in the neighboring tiles over in its halo
+(the tiles never write to the pixels of other tiles, so they need no synchronization). The tiles are scheduled
+dynamically on the OpenCV thread pool and only the tiles with some work are scheduled in each step.
+The processed pixels are ordered by tiles.
+*/
+template <typename label_t, typename NeighborhoodPolicy, typename ConditionPolicy>
+size_t grow_tiled(
+    Frontier& frontier,
+    StatePlane& states,
+    label_t* labels,
+    const ConditionPolicy& policy,
+    std::vector<pixel_idx_t>& processed,
+    int tile_size)
+{
+    assert(tile_size > 0);
+    const NeighborOffsets offsets(states.stride);
+    const int tiles_rows = (states.rows + tile_size - 1) / tile_size;
+    const int tiles_cols = (states.cols + tile_size - 1) / tile_size;
+    std::vector<GrowingTile> tiles;
+    tiles.reserve((size_t)tiles_rows * tiles_cols);
+    for (int row = 0; row < tiles_rows; ++row)
+        for (int col = 0; col < tiles_cols; ++col)
+            tiles.emplace_back(
+                row * tile_size, std::min(states.rows, (row+1) * tile_size),
+                col * tile_size, std::min(states.cols, (col+1) * tile_size));
+
+    // distribute the opened pixels between the tiles
+    frontier.advance();
+    for (auto pixel : frontier.current)
+        tiles[(states.row(pixel) / tile_size) * tiles_cols + states.col(pixel) / tile_size].frontier.open(pixel);
+    frontier.clear();
+
+    std::vector<int> scheduled;
+    size_t steps = 0;
+    while (true)
+    {
+        bool opened = false;
+        for (auto& tile : tiles)
+            opened = tile.frontier.advance() || opened;
+        if (!opened)
+            break;
+
+        if (NeighborhoodPolicy::use_n4(steps))
+            grow_step_tiled(tiles, tiles_cols, scheduled, states, labels, offsets.n4, NeighborOffsets::n4_rows, NeighborOffsets::n4_cols, policy);
+        else
+            grow_step_tiled(tiles, tiles_cols, scheduled, states, labels, offsets.n8, NeighborOffsets::n8_rows, NeighborOffsets::n8_cols, policy);
+        steps += 1;
+    }
+
+    for (auto& tile : tiles)
+        processed.insert(processed.end(), tile.processed.begin(), tile.processed.end());
+    return steps;
+}
 
 /*
 Abstract class for region growing - 
+The data are processed in a copy padded by one pixel from each side (so the linear pixel indices in data match
+the indices in state_plane), the groups are built from the (unpadded) output after the growing.
 */
 class Growing
 {
 public:
     std::unique_ptr<Groups> groups;
-    std::unique_ptr<PixelMat> pixel_mat;
+    std::unique_ptr<StatePlane> state_plane;
     Neighborhood neighborhood;
+    Frontier frontier;
+    // Use the multi-threaded growing kernel (deterministic for any number of threads, see grow_parallel)
+    bool parallel;
+    // Size of the tiles of the tiled growing kernel (see grow_tiled), 0 to grow the whole image at once
+    int tile_size;
     
     // Constructor that takes type of neighborhood (4/8-neighborhood or alternating)
     Growing(Neighborhood neighborhood);
     // Public wrapper function to run the growing. 
-    virtual size_t compute(cv::Mat& input_data, cv::Mat& output_data, std::unique_ptr<Groups>&& groups = nullptr, std::unique_ptr<PixelMat>&& pixel_mat = nullptr);
-    // Returns map of stored groups (assignment of values to individual pixels) and clears the variable.
+    virtual size_t compute(cv::Mat& input_data, cv::Mat& output_data, std::unique_ptr<StatePlane>&& state_plane = nullptr);
+    // Returns stored groups (assignment of non-zero values to individual pixels) and clears the variable.
     std::unique_ptr<Groups> clear_groups();
-    // Returns matrix stored in pixel_mat and clears the variable.
-    std::unique_ptr<PixelMat> clear_pixelmat();
+    // Returns plane stored in state_plane and clears the variable.
+    std::unique_ptr<StatePlane> clear_state_plane();
+    // Switch between the single-threaded and the multi-threaded growing kernel
+    void set_parallel(bool parallel);
+    // Use the tiled growing kernel with given size of tiles (gives the same result as the multi-threaded kernel, which can
+    // differ from the single-threaded kernel), 0 to disable it
+    void set_tile_size(int tile_size);
 
 protected:
-    // Main function that runs the growing
-    virtual size_t compute_inner(cv::Mat& input_output_data, bool create_new_pixelmat = true);
-    // Initialization of pixel_mat and opened pixels
-    virtual void init_funct(std::set<Pixel*>& opened, cv::Mat& data, bool create_new_pixelmat) = 0;
+    // Main function that runs the growing on data padded by one pixel from each side (see pad),
+    // by default it runs the growing kernel with the virtual grow_condition and assign
+    virtual size_t compute_inner(cv::Mat& input_output_data, bool create_new_state_plane = true);
+    // Initialization of state_plane and opened pixels
+    virtual void init_funct(Frontier& opened, cv::Mat& data, bool create_new_state_plane) = 0;
     // Possible postprocessing of pixels that were assigned a new value during the call of compute_inner
-    virtual void post_funct(std::vector<Pixel*>& processed, cv::Mat& data);
+    virtual void post_funct(std::vector<pixel_idx_t>& processed, cv::Mat& data);
     // Wrapper for assignment a new value to data
-    virtual void assign(cv::Mat& data, Pixel* from, Pixel* to);
+    virtual void assign(cv::Mat& data, pixel_idx_t from, pixel_idx_t to);
     // Wrapper for assignment a new value to data
-    virtual void assign(cv::Mat& data, int value, Pixel* to);
-    // Wrapper for adding pixel (pixel) to given group
-    virtual void add_to_group(Pixel* pixel, int cls);
-    // Checks if the the value from pixel should be assigned to its neighbor
-    virtual bool grow_condition(const cv::Mat& data, const cv::Mat& output, Pixel* pixel, Pixel* neighbor);
-    std::vector<Pixel*> get_neighbors(const Pixel* pixel, bool bool_4_8, std::size_t cols, std::size_t rows);
+    virtual void assign(cv::Mat& data, int value, pixel_idx_t to);
+    // Checks if the the value from pixel should be assigned to its neighbor (the kernel asks only for unseen neighbors)
+    virtual bool grow_condition(const cv::Mat& data, const cv::Mat& output, pixel_idx_t pixel, pixel_idx_t neighbor);
+
+    // Runs the growing kernel with given policies, derived classes use it to implement compute_inner
+    template <typename NeighborhoodPolicy, typename ConditionPolicy>
+    size_t compute_with_kernel(cv::Mat& data, bool create_new_state_plane, const ConditionPolicy& policy);
+
+    // Copy of the data padded by one (zero) pixel from each side
+    static cv::Mat pad(const cv::Mat& data);
+    // View of the original image in the padded data
+    static cv::Mat unpad(const cv::Mat& padded);
+
+private:
+    // Policy calling the virtual grow_condition and assign, used by the default implementation of compute_inner
+    class VirtualPolicy
+    {
+    public:
+        VirtualPolicy(Growing& growing, cv::Mat& data) : growing(growing), data(data) {}
+        bool condition(pixel_idx_t pixel, pixel_idx_t neighbor) const { return growing.grow_condition(data, data, pixel, neighbor); }
+        template <typename label_t>
+        void assign(label_t* labels, pixel_idx_t pixel, pixel_idx_t neighbor) const { growing.assign(data, pixel, neighbor); }
+    private:
+        Growing& growing;
+        cv::Mat& data;
+    };
 };
 
+template <typename NeighborhoodPolicy, typename ConditionPolicy>
+size_t Growing::compute_with_kernel(cv::Mat& data, bool create_new_state_plane, const ConditionPolicy& policy)
+{
+    assert(data.depth() == CV_16S || data.depth() == CV_32S);
+    assert(data.isContinuous());
+
+    frontier.clear();
+    init_funct(frontier, data, create_new_state_plane);
+
+    return with_label_type(data.depth(), [&](auto label)
+    {
+        using label_t = decltype(label);
+        label_t* labels = data.ptr<label_t>();
+        std::vector<pixel_idx_t> processed;
+        size_t steps;
+        if (tile_size > 0)
+            steps = grow_tiled<label_t, NeighborhoodPolicy>(frontier, *state_plane, labels, policy, processed, tile_size);
+        else if (parallel)
+            steps = grow_parallel<label_t, NeighborhoodPolicy>(frontier, *state_plane, labels, policy, processed);
+        else
+            steps = grow<label_t, NeighborhoodPolicy>(frontier, *state_plane, labels, policy, processed);
+        post_funct(processed, data);
+        return steps;
+    });
+}
+
 
 #endif /* GROWING_HPP */
\ No newline at end of file
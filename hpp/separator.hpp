@@ -3,58 +3,239 @@
 #define CLUSTERING_HPP
 
 #include "growing.hpp"
+#include <functional>
 #include <opencv2/core.hpp>
 
+// Key of the region of the pixel with given value used by the labeling (pixels with non-negative key are background)
+inline int32_t region_key(int32_t value, int bg_value)
+{
+    if (bg_value == 0 || value > bg_value)
+        return -value;
+    return value - bg_value;
+}
+
+// Size, sums of the coordinates (moments of order 0 and 1) and bounding box of the pixels of a region
+struct RegionStats
+{
+    uint64_t size = 0;
+    int64_t sum_row = 0;
+    int64_t sum_col = 0;
+    int min_row = std::numeric_limits<int>::max();
+    int min_col = std::numeric_limits<int>::max();
+    int max_row = -1;
+    int max_col = -1;
+
+    // Adds the pixel or the pixels of other region
+    void add(int row, int col)
+    {
+        ++size; sum_row += row; sum_col += col;
+        min_row = std::min(min_row, row); max_row = std::max(max_row, row);
+        min_col = std::min(min_col, col); max_col = std::max(max_col, col);
+    }
+    // Adds the run of pixels [begin, end) in the row
+    void add_run(int row, int begin, int end)
+    {
+        int64_t length = end - begin;
+        size += length; sum_row += row * length; sum_col += (int64_t)(begin + end - 1) * length / 2;
+        min_row = std::min(min_row, row); max_row = std::max(max_row, row);
+        min_col = std::min(min_col, begin); max_col = std::max(max_col, end - 1);
+    }
+    void add(const RegionStats& other)
+    {
+        size += other.size; sum_row += other.sum_row; sum_col += other.sum_col;
+        min_row = std::min(min_row, other.min_row); max_row = std::max(max_row, other.max_row);
+        min_col = std::min(min_col, other.min_col); max_col = std::max(max_col, other.max_col);
+    }
+    // Center of mass (x = column, y = row)
+    cv::Point2d center() const { return cv::Point2d((double)sum_col / size, (double)sum_row / size); }
+    cv::Rect bbox() const { return cv::Rect(min_col, min_row, max_col - min_col + 1, max_row - min_row + 1); }
+};
+
+/*
+Union-find (disjoint sets) of provisional region labels used by the connected-component labeling.
+Label 0 is reserved for the background, the sets are always united under the smaller root, so the root of each set
+is its smallest label (i.e. the label of the first pixel of the region in raster order).
+*/
+class LabelEquivalence
+{
+public:
+    std::vector<int32_t> parents;
+
+    LabelEquivalence();
+    // Creates new label forming its own set
+    int32_t add();
+    // Finds the root of the label (with path halving)
+    int32_t find(int32_t label);
+    // Unites the sets of both labels and returns the root of the united set
+    int32_t merge(int32_t a, int32_t b);
+    // Points every label directly to its root
+    void flatten();
+    // Number of labels including the background label
+    size_t size() const { return parents.size(); }
+};
+
+/*
+Lock-free union-find used by the parallel labeling. The labels are the indices of the pixels where the provisional
+regions were created (so the threads don't need to share a counter) and only these entries of parents are used.
+The sets are united under the smaller root by compare-and-swap, so the roots don't depend on the order of the merges
+and the root of each set is the label of the first pixel of the region in raster order, as in LabelEquivalence.
+*/
+class ConcurrentLabelEquivalence
+{
+public:
+    std::vector<int32_t> parents;
+
+    ConcurrentLabelEquivalence(size_t size);
+    // Creates new label forming its own set (the label must be used only by the calling thread until it is merged)
+    void add(int32_t label) { parents[label] = label; }
+    // Finds the root of the label (with path halving), can be called concurrently with other calls of find and merge
+    int32_t find(int32_t label);
+    // Unites the sets of both labels and returns the root of the united set, can be called concurrently
+    int32_t merge(int32_t a, int32_t b);
+};
+
 /*
 Separate image into regions of spatially closed pixels with the same color
-(i.e. pixels that have the same color but are not next to each other will be in different groups)
+(i.e. pixels that have the same color but are not next to each other will be in different groups).
+The regions are found by two-pass connected-component labeling with 4-neighborhood: the first pass assigns provisional
+labels and records their equivalences in union-find, the second pass assigns the final ids in raster order of the
+first pixels of the regions (the regions smaller than treshold get zero). The pixels of the removed regions
+are then filled by growing of the neighboring regions from the border of the removed areas.
+With set_parallel, the image is split into bands of rows labeled in parallel, then the labels across the seams
+between the bands are merged by lock-free union-find and the ids are assigned in parallel (the result is the same).
+The input is a label image (CV_16S or CV_32S), the output is 16-bit if there are at most 32767 regions, 32-bit otherwise.
 */
 class Separator : public Growing
 {
 public:
     size_t treshold;
     int bg_value;
+    // Stats of the regions accumulated during the labeling (the region with id i has stats[i-1]), including
+    // the pixels filled after tresholding
+    std::vector<RegionStats> stats;
 
     Separator(size_t treshold = 50, int bg_value = 0);
-    virtual size_t compute(cv::Mat& data, cv::Mat& output,
-        std::unique_ptr<Groups>&& groups = nullptr,
-        std::unique_ptr<PixelMat>&& pixel_mat = nullptr) override;
+    // Build the groups after the computation (true by default), the stats are enough to find the centers of the regions
+    void set_build_groups(bool build_groups);
+    virtual size_t compute(cv::Mat& data, cv::Mat& output, std::unique_ptr<StatePlane>&& state_plane = nullptr) override;
 
 protected:
-    /* Helper class to remove regions that were removed by Separator because of region size tresholding.
-     * Find the border of the areas of pixels that were removed by tresholding (i.e. 'background' pixels)
-     * and grows the neighbors to remove these areas
-     */
-    class AfterTresholdGrowing : public Growing
+    bool build_groups;
+    // Image indices of pixels of the regions removed by tresholding
+    std::vector<pixel_idx_t> removed;
+
+    // Labels the regions of padded data (negative values are keys of the regions, other pixels are background)
+    // in place, fills the removed regions and returns the number of regions
+    virtual size_t compute_inner(cv::Mat& data, bool create_new_state_plane = true) override;
+    // Id given to the regions smaller than treshold during the labeling (the pixels are set to zero afterwards)
+    static constexpr int32_t removed_id = -1;
+
+    // Resolves the equivalences of provisional labels, sums up their stats and returns ids of the regions for each
+    // provisional label (ids are given in raster order, the regions smaller than treshold get removed_id), fills stats
+    std::vector<int32_t> region_ids(LabelEquivalence& equivalence, std::vector<RegionStats>& label_stats);
+    // Replaces the provisional labels of padded data by the ids from the lookup table (in parallel by rows, vectorized),
+    // if collect_removed is true, the pixels with removed_id are set to zero and stored in removed
+    void relabel(cv::Mat& data, const int32_t* lut, bool collect_removed);
+    // Labeling of the whole image by one thread
+    size_t label_regions(cv::Mat& data);
+    // Labeling of bands of rows in parallel
+    size_t label_regions_parallel(cv::Mat& data);
+    // Initialization of the filling of the removed regions - the removed pixels are marked as 'unseen' and the
+    // labeled pixels next to them are opened (the state plane must be prepared with all the pixels 'closed')
+    virtual void init_funct(Frontier& opened, cv::Mat& data, bool create_new_state_plane) override;
+
+};
+
+/*
+Separator for binary images (CV_8U, all non-zero pixels are one foreground) - gives the same output as Separator with
+bg_value = 0 would give for the image converted to CV_16S (if there is just one non-zero value), but the rows are packed to 64-bit words and the regions are labeled by runs of foreground pixels
+instead of single pixels: runs overlapping with a run of the previous row are united in union-find, the sizes of
+the regions (and their stats) are summed from the runs. Packing of the rows and writing of the output run in parallel,
+with set_parallel the runs are labeled in parallel by bands of rows as well (the result is the same).
+*/
+class BinarySeparator : public Separator
+{
+public:
+    BinarySeparator(size_t treshold = 50);
+    virtual size_t compute(cv::Mat& data, cv::Mat& output, std::unique_ptr<StatePlane>&& state_plane = nullptr) override;
+
+protected:
+    // Run of foreground pixels [begin, end) in one row with its provisional label
+    struct Run
     {
-    public:
-        int rows;
-        int cols;
-        AfterTresholdGrowing(int rows, int cols);
-        virtual size_t compute(cv::Mat& data, cv::Mat& output,
-            std::unique_ptr<Groups>&& groups = nullptr,
-            std::unique_ptr<PixelMat>&& pixel_mat = nullptr) override;
-    private:
-        void remap(cv::Mat& data);
-        virtual void init_funct(std::set<Pixel*>& opened, cv::Mat& data, bool create_new_pixelmat) override;
+        int begin;
+        int end;
+        int32_t label;
     };
 
-    int n;
-    int last_row;
-    int last_col;
+    // Finds the runs of foreground pixels in each row
+    static void find_runs(const cv::Mat& data, std::vector<std::vector<Run>>& runs);
+    // Labels the runs, fills stats and returns ids of the regions for each label (see region_ids)
+    std::vector<int32_t> label_runs(std::vector<std::vector<Run>>& runs);
+    // Labeling of the runs in bands of rows in parallel, the labels across the seams are merged by lock-free union-find
+    std::vector<int32_t> label_runs_parallel(std::vector<std::vector<Run>>& runs);
+};
 
-    const cv::Mat* input_data;
 
-    virtual void init_funct(std::set<Pixel*>& opened, cv::Mat& data, bool create_new_pixelmat) override;
-    virtual void post_funct(std::vector<Pixel*>& processed, cv::Mat& data) override;
-    virtual void add_to_group(Pixel* pixel, int cls) override;
-    virtual bool grow_condition(const cv::Mat& data, const cv::Mat& output, Pixel* pixel, Pixel* neighbor) override;
 
-};
 
 
 
+/*
+Separator for images that don't fit in memory - the image is pushed by bands of rows (of any height) and only
+the labels of the last row and the equivalence table of the regions reaching it are kept. The pixels are labeled
+in the same way as by Separator (4-neighborhood, the same background value), but the labels are given to the stats
+of the regions instead of the output image: after each row the regions that don't continue to this row can't grow
+any more, so they are passed to the callback (if they have at least treshold pixels) and forgotten, the others are
+relabeled to continuous range. So the memory doesn't depend on the number of rows.
+The regions smaller than treshold are just dropped (they can't be filled by their neighbors as in Separator).
+*/
+class StreamingSeparator
+{
+public:
+    // Finished region with id (ids are given from 1 in the order in which the regions are finished)
+    struct Component
+    {
+        int id;
+        int value;
+        RegionStats stats;
+    };
+    typedef std::function<void(const Component&)> component_funct_t;
 
+    StreamingSeparator(int cols, component_funct_t component_funct, size_t treshold = 50, int bg_value = 0);
+    // Labels next rows of the image (single channel CV_16S or CV_32S image with the same number of columns as the image)
+    void push(const cv::Mat& rows);
+    // Finishes the regions of the last row, the separator can be used for next image afterwards
+    void finish();
+    // Number of rows pushed since the beginning of the image
+    int rows() const { return row; }
 
+private:
+    int cols;
+    component_funct_t component_funct;
+    size_t treshold;
+    int bg_value;
+    int row;
+    int n;
+
+    // Labels and keys of the last row (padded by one background pixel from each side)
+    std::vector<int32_t> up_labels;
+    std::vector<int32_t> up_keys;
+    // Equivalences, stats and values of the labels of the regions reaching the last row
+    LabelEquivalence equivalence;
+    std::vector<RegionStats> stats;
+    std::vector<int> values;
+    // Buffers of the row being labeled (kept between the rows, so the labeling of a row doesn't allocate memory)
+    std::vector<int32_t> row_labels;
+    std::vector<int32_t> row_keys;
+    std::vector<int32_t> new_labels;
+    std::vector<RegionStats> new_stats;
+    std::vector<int> new_values;
+
+    template <typename label_t>
+    void push_row(const label_t* row_values);
+    // Passes the region to the callback if it is large enough
+    void emit(int32_t label);
+};
 
 #endif /* CLUSTERING_HPP */
\ No newline at end of file
@@ -0,0 +1,21 @@
+#ifndef SIMD_HPP
+#define SIMD_HPP
+
+/*
+Vectorized kernels are compiled for x86 with the instruction set enabled per function (VORONIZER_TARGET), so the
+binary doesn't require them - the kernel is selected at runtime by cv::checkHardwareSupport.
+VORONIZER_AVX2 and VORONIZER_SSE41 are defined if the kernels for the instruction set can be compiled.
+*/
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+    #include <immintrin.h>
+    #define VORONIZER_AVX2
+    #define VORONIZER_SSE41
+    #define VORONIZER_TARGET(isa) __attribute__((target(isa)))
+#elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+    #include <immintrin.h>
+    #define VORONIZER_AVX2
+    #define VORONIZER_SSE41
+    #define VORONIZER_TARGET(isa)
+#endif
+
+#endif /* SIMD_HPP */
@@ -36,10 +36,75 @@ void randomLUT(const cv::Mat& src, cv::Mat& dst);
 void smoothEdges(cv::InputArray src, cv::OutputArray dst, int ksize=9, int iter=3);
 cv::Mat colorizeByCmap(const cv::Mat& input, cv::ColormapTypes map = cv::COLORMAP_TWILIGHT, bool copy = true, bool apply_random_LUT = false);
 cv::Mat colorizeByTemplate(const cv::Mat& color_template, const Groups* voronoi_groups);
-void kmeansColor(cv::Mat ocv, cv::Mat& output, int K);
+// Clusters the colors of the image by KMeans, returns the cluster of each pixel (CV_32S, numbered from 1),
+// the centers of the clusters are stored to centers if it isn't null
+cv::Mat kmeansLabels(const cv::Mat& input, int K, cv::Mat* centers = nullptr);
+// Clusters the colors of 8-bit image by weighted KMeans of the non-empty bins of its color histogram (with given bits
+// per channel) and maps the pixels through the clusters of their bins - much faster than kmeansLabels on large images,
+// the output has the same format as of kmeansLabels (there may be less than K clusters if the image has less colors)
+cv::Mat histogramLabels(const cv::Mat& input, int K, cv::Mat* centers = nullptr, int bits = 5);
+// Default size of the subsample of subsampleLabels (number of pixels) and the tolerance of the drift of its centers
+constexpr double default_subsample = 50000;
+constexpr double default_max_drift = 1.0;
+// Clusters the colors of 8-bit image by KMeans of a strided subsample of its pixels (fraction of the pixels if sample
+// is at most 1, number of pixels otherwise), then assigns all the pixels to the nearest centers by vectorized kernel -
+// if the means of the clusters drift more than max_drift from the centers, they are refined over all the pixels
+// (negative max_drift skips the check, the output has the same format as of kmeansLabels)
+cv::Mat subsampleLabels(const cv::Mat& input, int K, cv::Mat* centers = nullptr, double sample = default_subsample,
+    double max_drift = default_max_drift);
+// Default drift of the centers of warmStartLabels that is stable (needs no more iterations) and that needs new
+// initialization
+constexpr double default_stable_drift = 1.0;
+constexpr double default_reset_drift = 10.0;
+// Clusters the colors of 8-bit image by Lloyd iterations starting from the given centers (e.g. the centers of the
+// previous frame) - the first iteration is enough if the means of the clusters drift at most stable_drift from the
+// centers (or if stable_drift is negative), otherwise there is one more. Returns false if the centers don't fit
+// the image (they drift more than reset_drift or they have different number of channels), then the centers are left
+// unchanged and the image needs to be quantized from scratch. Otherwise the labels (numbered from 1) are stored
+// and the centers are updated.
+bool warmStartLabels(const cv::Mat& input, cv::Mat& centers, cv::Mat& labels, double stable_drift = default_stable_drift,
+    double reset_drift = default_reset_drift);
+
+/*
+Divisive hierarchical clustering of the colors of 8-bit image - the bins of the color histogram (with given bits per
+channel) start in one cluster and the cluster with the largest squared error is repeatedly split into two by weighted
+2-means until there are max_colors clusters (or no cluster can be split). The tree of the splits gives the clustering
+with any number of colors up to max_colors, so the labels of each level are found just by one pass over the pixels
+through the lookup table of the bins.
+*/
+class PaletteTree
+{
+public:
+    PaletteTree(const cv::Mat& input, int max_colors, int bits = 5);
+    // Labels of the pixels with given number of colors (numbered from 1, the same format as of kmeansLabels),
+    // the centers of the clusters are stored to centers if it isn't null
+    cv::Mat labels(int n_colors, cv::Mat* centers = nullptr) const;
+    // Number of the clusters of the last level
+    int levels() const { return (int)parents.size(); }
+
+private:
+    cv::Mat image;
+    int bits;
+    int channels;
+    // non-empty bins of the histogram, their number of pixels and mean colors and their clusters in the last level
+    std::vector<uint32_t> bins;
+    std::vector<double> weights;
+    std::vector<double> colors;
+    std::vector<int> clusters;
+    // cluster split by the creation of each cluster (cluster k is created by the split from level k to k + 1)
+    std::vector<int> parents;
+};
+
+// Algorithm used to quantize the colors of the image
+enum class ColorQuantizer {kmeans, histogram, subsample, hierarchical};
+// Clusters the colors by the selected quantizer (sample and max_drift are used only by the subsample quantizer)
+cv::Mat quantizeLabels(const cv::Mat& input, int K, ColorQuantizer quantizer, cv::Mat* centers = nullptr,
+    double sample = default_subsample, double max_drift = default_max_drift);
 void fitImage(const cv::Mat& src, cv::Mat& dst, uint size);
 
 cv::Mat linesFromClosestPointsRandom(std::vector<cv::Point2f>& pts, cv::Size image_size, size_t iter, size_t pts_left_out = 3);
+// Pairs every point with its closest unused point (in random order given by the seed) by the grid of the points
+cv::Mat linesFromClosestPoints(const std::vector<cv::Point2f>& pts, cv::Size image_size, unsigned seed = 0, size_t pts_left_out = 3);
 
 
 template <typename T>
@@ -7,7 +7,11 @@
 #include <memory>
 #include <opencv2/core.hpp>
 #include <opencv2/imgproc.hpp>
+#include <opencv2/features2d.hpp>
 #include "growing.hpp"
+#include "voronoi.hpp"
+#include "separator.hpp"
+#include "utils.hpp"
 
 typedef std::function<cv::Mat(const cv::Mat& input, const cv::Mat& voronoi_output, const Groups* voronoi_groups)> color_funct_t;
 
@@ -23,10 +27,29 @@ public:
     void set_colormap(cv::ColormapTypes cmap_type, bool random);
     // Sets the colorization function to use image template - each region will be colored by average color of underlying pixels of input image 
     void unset_colormap();
+    // Set the algorithm used to compute the voronoi diagram from generators,
+    // if report is true, the diagram is computed by region growing as well and the differences are printed to stderr
+    void set_engine(VoronoiEngine engine, bool report = false);
+    // Use multi-threaded region growing (in Separator and "growing" engine)
+    void set_parallel(bool parallel);
+    // Use tiled region growing with given size of tiles in "growing" engine (0 to disable it), the result is the same
+    // as of the multi-threaded growing (set_parallel), not as of the default single-threaded growing
+    void set_tile_size(int tile_size);
+    // Set the seed of the order of the points paired by their closest points in *-lines modes with RANDOM_ITER=0
+    void set_seed(unsigned seed);
     virtual ~AbstractVoronizer() = default;
 
 protected:
+    VoronoiEngine engine;
+    bool report;
+    bool parallel;
+    int tile_size;
+    unsigned seed;
+
     AbstractVoronizer();
+    // Compute voronoi diagram from the generators by the selected engine and return the groups of pixels of each cell
+    // (state_plane of the same size can be passed to be reused by the growing engine)
+    std::unique_ptr<Groups> computeVoronoi(cv::Mat& generators, cv::Mat& output, std::unique_ptr<StatePlane>&& state_plane = nullptr);
     // Colorization by OpenCV cmap
     cv::Mat colorize_funct_cmap(const cv::Mat& input, const cv::Mat& voronoi_output, const Groups* voronoi_groups);
     // Colorization by average color of pixel in each group
@@ -74,7 +97,7 @@ protected:
 /*
 Voronizer class where generators are created by KMeans color clustering - generators are created from centers of mass of regions found by KMeans:
 1. preprocess image by median filter of size MEDIAN_PRE
-2. quantize the image to N_COLORS by KMeans
+2. quantize the image to N_COLORS by KMeans (of all the pixels, of the bins of the color histogram or of a subsample, or hierarchically, see set_quantizer)
 3. split the clusters into regions of spatially close pixels with the same color and remove any with less than CLUSTER_SIZE_TRESHOLD pixels
 (4. use centers of mass of the regions to create generators via abstract "drawGenerators" member function) 
 */
@@ -92,14 +115,43 @@ public:
         size_t cluster_size_treshold = default_cluster_size_treshold
     );
     virtual cv::Mat run(cv::Mat& input);
+    // Run the Voronizer for each given number of colors (instead of N_COLORS) - the colors are clustered only once
+    // by PaletteTree (regardless of the quantizer), then each level is separated and voronized
+    std::vector<cv::Mat> runSweep(cv::Mat& input, const std::vector<size_t>& n_colors_levels);
+    // Set the algorithm used to quantize the colors (KMeans of all the pixels by default), sample and max_drift
+    // are used by the subsample quantizer (see subsampleLabels)
+    void set_quantizer(ColorQuantizer quantizer, double sample = default_subsample, double max_drift = default_max_drift);
+    // Start the quantization of each image from the palette of the previous image run by this instance (for sequences
+    // of similar images, e.g. video frames) - the palette is quantized from scratch only if it drifts more than
+    // reset_drift and it is refined by one more iteration if it drifts more than stable_drift (see warmStartLabels,
+    // independent on the tolerance of the subsample quantizer), disabling the warm start forgets the palette
+    void set_warm_start(bool warm_start, double reset_drift = default_reset_drift, double stable_drift = default_stable_drift);
+    // Label the regions by StreamingSeparator pushed by bands of rows instead of Separator - the regions smaller than
+    // CLUSTER_SIZE_TRESHOLD are dropped instead of filled by their neighbors (so the centers can be slightly different)
+    void set_streaming(bool streaming);
 
 protected:
     size_t median_pre;
     size_t n_colors;    
     size_t cluster_size_treshold;
-
-    // Draw an image of generators (given the computed groups) 
-    virtual cv::Mat drawGenerators(const Groups* groups, cv::Size image_size) = 0;
+    ColorQuantizer quantizer;
+    double sample;
+    double max_drift;
+    bool warm_start;
+    double reset_drift;
+    double stable_drift;
+    bool streaming;
+    // Height of the bands of rows pushed to StreamingSeparator
+    static constexpr int stream_band_rows = 256;
+    // Centers of the colors of the last image (used by the warm start)
+    cv::Mat palette;
+
+    // Median filter of the input
+    cv::Mat preprocess(const cv::Mat& input);
+    // Separate the quantized colors into regions and voronize them
+    cv::Mat runClusters(cv::Mat& input, cv::Mat& clusters);
+    // Draw an image of generators (given the stats of the regions, the region with id i has regions[i-1])
+    virtual cv::Mat drawGenerators(const std::vector<RegionStats>& regions, cv::Size image_size) = 0;
 };
 
 /*
@@ -134,8 +186,8 @@ protected:
     size_t radius;
     int thickness;
 
-    // Draw an image of generators (given the computed groups)
-    virtual cv::Mat drawGenerators(const Groups* groups, cv::Size image_size) override;
+    // Draw an image of generators (given the stats of the regions)
+    virtual cv::Mat drawGenerators(const std::vector<RegionStats>& regions, cv::Size image_size) override;
 
 };
 
@@ -145,6 +197,7 @@ Voronizer class where generators are created by KMeans color clustering - genera
 2. quantize the image to N_COLORS by KMeans
 3. split the clusters into regions of spatially close pixels with the same color and remove any with less than CLUSTER_SIZE_TRESHOLD pixels
 4. use centers of mass of the regions as endpoints of line segment generators - for each point try RANDOM_ITER other (unused) points and select the closest one to create new line segment
+    (RANDOM_ITER=0 to select the closest of all the unused points, found by the grid of the points)
 */
 class KMeansVoronizerLines : public AbstractKMeansVoronizer
 {
@@ -164,15 +217,18 @@ public:
 protected:
     size_t n_iter;
 
-    // Draw an image of generators (given the computed groups)
-    virtual cv::Mat drawGenerators(const Groups* groups, cv::Size image_size) override;
+    // Draw an image of generators (given the stats of the regions)
+    virtual cv::Mat drawGenerators(const std::vector<RegionStats>& regions, cv::Size image_size) override;
 
 };
 
 
+// Detector of the keypoints used by the sift-* modes (only the positions and the sizes of the keypoints are used)
+enum class KeypointDetector {sift, fast, agast, gftt, orb};
+
 /*
 Abstract Voronizer class where generators are created from SIFT keypoints:
-1. Detect SIFT keypoints of the image
+1. Detect SIFT keypoints of the image (or keypoints of other detector, see set_detector)
 2. Filter out keypoints of size less than KEYPOINT_SIZE_TRESHOLD
 (3. use SIFT keypoints to create generators via abstract "drawGenerators" member function) 
 */
@@ -180,12 +236,35 @@ class AbstractSIFTVoronizer : public AbstractVoronizer
 {
 public:
     static constexpr size_t default_keypoint_size_treshold = 5;
+    // Size of all the keypoints of the single-scale detectors (FAST, AGAST, GFTT)
+    static constexpr size_t corner_keypoint_size = 7;
+    // Size of the largest keypoints detected in the tiles (see set_detection_tiles)
+    static constexpr int default_detection_max_size = 64;
 
     AbstractSIFTVoronizer(size_t keypoint_size_treshold = default_keypoint_size_treshold);
     virtual cv::Mat run(cv::Mat& input) override;
+    // Set the detector of the keypoints (SIFT by default) - the single-scale detectors (FAST, AGAST, GFTT) give all
+    // the keypoints the same size (7 pixels), so their keypoints are not filtered by KEYPOINT_SIZE_TRESHOLD,
+    // ORB gives the size of its patch at the scale of the keypoint
+    void set_detector(KeypointDetector detector);
+    // Detect the keypoints in tiles of given size in parallel (0 to detect them in the whole image at once) - the tiles
+    // give the keypoints up to detection_max_size and they are extended by the overlap needed by the octave of these
+    // keypoints (see detectKeypoints), the larger keypoints are detected in the downscaled image
+    void set_detection_tiles(int detection_tile_size, int detection_max_size = default_detection_max_size);
 
 protected:
     size_t keypoint_size_treshold;
+    KeypointDetector detector;
+    int detection_tile_size;
+    int detection_max_size;
+
+    // Create the selected detector, the detectors with the limit of the number of keypoints (GFTT, ORB) get given
+    // share of the limit (for a part of the image)
+    cv::Ptr<cv::Feature2D> createDetector(double share = 1.0) const;
+    // True if the sizes of the keypoints of the selected detector are given by their scale
+    bool hasScale() const;
+    // Detect the keypoints of the image (in tiles if they are set)
+    std::vector<cv::KeyPoint> detectKeypoints(const cv::Mat& input) const;
 
     // Draw an image of generators (given the computed groups)
     virtual cv::Mat drawGenerators(std::vector<cv::KeyPoint> keypoints, cv::Size image_size) = 0;
@@ -236,7 +315,8 @@ Voronizer class where generators are created with SIFT keypoints - generators ar
 1. Detect SIFT keypoints of the image
 2. Filter out keypoints of size less than KEYPOINT_SIZE_TRESHOLD
 3. use selected SIFT keypoints as endpoints of line segment generators - for each point try RANDOM_ITER other (unused) points
-    and select the closest one to create new line segment
+    and select the closest one to create new line segment (RANDOM_ITER=0 to select the closest of all the unused points,
+    found by the grid of the points)
 */
 class SIFTVoronizerLines : public AbstractSIFTVoronizer
 {
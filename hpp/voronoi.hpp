@@ -2,6 +2,7 @@
 #ifndef VORONOI_HPP
 #define VORONOI_HPP
 
+#include <ostream>
 #include <opencv2/core.hpp>
 #include "growing.hpp"
 
@@ -12,9 +13,83 @@ public:
     Voronoi();
 
 private:
-    virtual void init_funct(std::set<Pixel*>& opened, cv::Mat& data, bool create_new_pixelmat) override;
+    virtual size_t compute_inner(cv::Mat& data, bool create_new_state_plane = true) override;
+    virtual void init_funct(Frontier& opened, cv::Mat& data, bool create_new_state_plane) override;
 
 };
 
+/*
+Exact Euclidean Voronoi diagram from raster generators (same input convention as Voronoi - non-zero pixels are generators).
+Every pixel gets the value of its nearest generator pixel. The nearest generators are found by separable linear-time
+distance transform (Felzenszwalb & Huttenlocher) propagating the generator positions: first pass finds the nearest
+generator pixel in each column, second pass computes the lower envelope of parabolas in each row.
+Both passes run in parallel (columns/rows are split between threads).
+*/
+class EDTVoronoi
+{
+public:
+    std::unique_ptr<Groups> groups;
+
+    EDTVoronoi();
+    // Computes the diagram, input and output are single channel label images (CV_16S or CV_32S)
+    void compute(const cv::Mat& input_data, cv::Mat& output_data);
+    // Returns stored groups (assignment of values to individual pixels) and clears the variable.
+    std::unique_ptr<Groups> clear_groups();
+
+private:
+    // Finds the row of the nearest generator pixel in the same column (or -1 if there is none) for each pixel
+    template <typename label_t>
+    static void nearest_in_columns(const cv::Mat& input, cv::Mat& nearest_row);
+    // Finds the nearest generator for each pixel by combining the column results along rows and assigns its value
+    template <typename label_t>
+    static void nearest_in_rows(const cv::Mat& input, const cv::Mat& nearest_row, cv::Mat& output);
+};
+
+/*
+Approximate Euclidean Voronoi diagram from raster generators computed by Jump Flooding Algorithm (Rong & Tan).
+Every pixel keeps the position of the nearest generator pixel found so far. In each pass the pixel compares it with
+the generators kept by its 8 neighbors in distance 'step' and the step is halved after each pass (log2(N) passes).
+The 1+JFA variant runs one additional pass with step 1 before the others, which removes most of the errors.
+The comparisons of one row are vectorized (AVX2/SSE4.1 selected at runtime), the rows are split between threads.
+Supports images with at most 32767 rows and columns (the positions are packed in 16-bit pairs).
+*/
+class JFAVoronoi
+{
+public:
+    std::unique_ptr<Groups> groups;
+
+    JFAVoronoi(bool extra_pass = false);
+    // Computes the diagram, input and output are single channel label images (CV_16S or CV_32S)
+    void compute(const cv::Mat& input_data, cv::Mat& output_data);
+    // Returns stored groups (assignment of values to individual pixels) and clears the variable.
+    std::unique_ptr<Groups> clear_groups();
+
+private:
+    bool extra_pass;
+
+    // One pass of the algorithm - finds the nearest of the generators stored in src in distance 'step' (CV_32S)
+    static void jump(const cv::Mat& src, cv::Mat& dst, int step);
+};
+
+// Types of algorithms used to compute the Voronoi diagram
+enum class VoronoiEngine {growing, edt, jfa, jfa_extra_pass};
+
+// Difference of a voronoi diagram from the reference diagram computed by region growing (see compareVoronoi)
+struct VoronoiDifference
+{
+    size_t pixels = 0;
+    // pixels with a different value than in the reference
+    size_t different_pixels = 0;
+    // cells (values) of the reference
+    size_t cells = 0;
+    // cells of the reference with at least one different pixel
+    size_t different_cells = 0;
+};
+
+// Compare two voronoi diagrams of the same generators (CV_16S or CV_32S)
+VoronoiDifference compareVoronoi(const cv::Mat& output, const cv::Mat& reference);
+std::ostream& operator<<(std::ostream& os, const VoronoiDifference& difference);
+
+
 
 #endif /* VORONOI_HPP */
\ No newline at end of file